@@ -30,7 +30,9 @@ import socket,os,struct, time
 import numpy as np
 import hashlib
 import binascii
+import zlib
 import sys
+import re
 
 
 # Args for setting IP/port of AI-deck. Default settings are for when
@@ -38,11 +40,29 @@ import sys
 parser = argparse.ArgumentParser(description='Bootload the GAP8 on the AI-deck')
 parser.add_argument("-n",  default="192.168.4.1", metavar="ip", help="AI-deck IP")
 parser.add_argument("-p", type=int, default='5000', metavar="port", help="AI-deck port")
+parser.add_argument("-f", action="store_true", help="write the full image instead of only the changed pages")
+parser.add_argument("-z", action="store_true", help="compress the image while uploading it")
+parser.add_argument("-w", type=int, default='8', metavar="window", help="max chunks in flight when writing")
+parser.add_argument("-a", default="crc32", choices=["md5", "crc32", "sha256"], help="digest used to verify the image")
+parser.add_argument("-c", action="store_true", help="protect each chunk with a CRC and only resend the damaged ones")
+parser.add_argument("-b", type=int, metavar="ms", help="boot the verified application if no host connects within ms after reset, -1 to disable")
+parser.add_argument("-s", action="store_true", help="print the bootloader performance counters of the update")
+parser.add_argument("-t", metavar="file", help="save the bootloader event trace of the update to file, see tools/trace")
+parser.add_argument("-d", type=lambda x: int(x, 0), metavar="size", help="dump size bytes of the application area to image instead of flashing")
 parser.add_argument('image', metavar='image', help='firmware image to flash')
 args = parser.parse_args()
 
 deck_port = args.p
 deck_ip = args.n
+window = args.w
+fullWrite = args.f
+compress = args.z
+dumpSize = args.d
+autoBootWait = args.b
+printStats = args.s
+crcChunks = args.c
+traceName = args.t
+digestName = args.a
 imageName = args.image
 
 print("Connecting to socket on {}:{}...".format(deck_ip, deck_port))
@@ -79,6 +99,210 @@ class CPXFunction:
   TEST = 0x0E
   BOOTLOADER = 0x0F
 
+class BLDigest:
+  """
+  Digest algorithms supported by the bootloader
+  """
+  MD5 = 0
+  CRC32 = 1
+  SHA256 = 2
+  NONE = 0xFF
+
+  byName = {"md5": MD5, "crc32": CRC32, "sha256": SHA256}
+
+  @staticmethod
+  def calculate(algorithm, data):
+    if algorithm == BLDigest.MD5:
+      return hashlib.md5(data).digest()
+    if algorithm == BLDigest.CRC32:
+      return struct.pack("<I", zlib.crc32(data) & 0xFFFFFFFF)
+    if algorithm == BLDigest.SHA256:
+      return hashlib.sha256(data).digest()
+    raise Exception("Unknown digest algorithm {}".format(algorithm))
+
+class BLStats:
+  """
+  Names of the performance counters, followed by one counter per command and
+  the counters added after those
+  """
+  names = ["flash erase", "flash program", "flash read", "spi transfer", "com read wait", "com write wait"]
+  commands = 17
+  added = ["com rx dropped", "flash lock wait", "erase wait"]
+  # Their count is the stack size and max the most used of it, in bytes
+  stacks = ["bl stack", "com stack", "flash stack", "erase stack"]
+
+class BLFeature:
+  """
+  Features reported by the GAP8 in the info, the first version doesn't have
+  the info command and none of them
+  """
+  WRITE_WINDOWED = 1 << 0
+  HASHMAP = 1 << 1
+  LZ = 1 << 2
+  DIGEST = 1 << 3
+  WRITE_VERIFY = 1 << 4
+  BOOT_CONFIG = 1 << 5
+  IMAGE = 1 << 6
+  STATS = 1 << 7
+  TRACE = 1 << 8
+  BATCH = 1 << 9
+  WRITE_CRC = 1 << 10
+  JOURNAL = 1 << 11
+  SPARSE = 1 << 12
+  ERASE = 1 << 13
+  BLANK_CHECK = 1 << 14
+  WRITE_DATA = 1 << 15
+
+class BLWriteStatus:
+  """
+  Status in the ACKs of a windowed write
+  """
+  OK = 0
+  DONE = 1
+  OUT_OF_ORDER = 2
+  OVERFLOW = 3
+  CORRUPT = 4
+  BAD_CRC = 5
+  GAPS = 6
+  UNSUPPORTED = 7
+
+class BLWriteRefused(Exception):
+  """
+  The GAP8 refused a write, for instance since it can't keep the rest of the
+  sectors it only partly covers
+  """
+  pass
+
+def _lzLength(value):
+  """Extra length bytes for a token nibble of 15"""
+  out = bytearray()
+  value -= 15
+  while value >= 255:
+    out.append(255)
+    value -= 255
+  out.append(value)
+  return out
+
+def _lzMatchLength(data, a, b, maxLength):
+  length = 0
+  step = 64
+  while length < maxLength:
+    n = min(step, maxLength - length)
+    if data[a+length:a+length+n] == data[b+length:b+length+n]:
+      length += n
+    elif n > 1:
+      step = max(1, n // 2)
+    else:
+      break
+  return length
+
+def lzCompress(data, window=4096, minMatch=4):
+  """
+  Compress data to the LZ4 style stream decoded by the GAP8 (see src/lz.h),
+  offsets are limited to half of the window
+  """
+  maxOffset = window // 2
+  data = bytes(data)
+  out = bytearray()
+  table = {}
+  literalStart = 0
+  i = 0
+  while i + minMatch <= len(data):
+    key = data[i:i+minMatch]
+    candidate = table.get(key)
+    table[key] = i
+    if candidate is None or i - candidate > maxOffset:
+      i += 1
+      continue
+
+    length = minMatch + _lzMatchLength(data, candidate + minMatch, i + minMatch, len(data) - i - minMatch)
+    literals = i - literalStart
+    matchCode = length - minMatch
+    out.append((min(literals, 15) << 4) | min(matchCode, 15))
+    if literals >= 15:
+      out.extend(_lzLength(literals))
+    out.extend(data[literalStart:i])
+    out.extend(struct.pack("<H", i - candidate))
+    if matchCode >= 15:
+      out.extend(_lzLength(matchCode))
+
+    i += length
+    literalStart = i
+
+  literals = len(data) - literalStart
+  if literals > 0:
+    out.append(min(literals, 15) << 4)
+    if literals >= 15:
+      out.extend(_lzLength(literals))
+    out.extend(data[literalStart:])
+  return out
+
+def sparseChunks(data, maxChunkSize, minRun=32):
+  """
+  Split data into chunks of runs for a sparse write, runs of at least minRun
+  erased (0xFF) or zero bytes are sent as only their size
+  """
+  chunks = []
+  chunk = bytearray()
+
+  def add(runType, size, payload=b""):
+    nonlocal chunk
+    if len(chunk) + 5 + len(payload) > maxChunkSize:
+      chunks.append(chunk)
+      chunk = bytearray()
+    chunk += struct.pack("<BI", runType, size) + payload
+
+  def addData(start, end):
+    while start < end:
+      # Fill up the chunk, it's only worth starting a new run if some data fits
+      space = maxChunkSize - len(chunk) - 5
+      if space < 64:
+        space = maxChunkSize - 5
+      size = min(space, end - start)
+      add(0, size, data[start:start+size])
+      start += size
+
+  offset = 0
+  for blank in re.finditer(b"\xff{%d,}|\x00{%d,}" % (minRun, minRun), data):
+    addData(offset, blank.start())
+    add(1 if data[blank.start()] == 0xFF else 2, blank.end() - blank.start())
+    offset = blank.end()
+  addData(offset, len(data))
+
+  if len(chunk) > 0:
+    chunks.append(chunk)
+  return chunks
+
+def imageLayout(data):
+  """
+  What a GAP8 image takes in flash, relative to its start, as lists of
+  (name, offset, size). The first is from the binary header and its segments,
+  the second from the partition table at the end of the binary, if there is
+  one, as partitions like readfs can be placed past the end of the image.
+  """
+  if len(data) < 16:
+    return ([], [])
+  [size, nSegments] = struct.unpack("<II", data[0:8])
+  if nSegments == 0 or nSegments > 16 or len(data) < 16 + nSegments * 16:
+    return ([], [])
+  binary = [("binary", 0, size)]
+  for i in range(nSegments):
+    [offset, _, segmentSize, _] = struct.unpack("<IIII", data[16+i*16:32+i*16])
+    binary.append(("segment {}".format(i), offset, segmentSize))
+
+  # Partition table header (magic 0x01AA) and 32 byte entries (magic 0x02AA)
+  partitions = []
+  if size + 32 <= len(data) and struct.unpack("<H", data[size:size+2])[0] == 0x01AA:
+    entries = data[size+3]
+    for i in range(entries):
+      entry = data[size+32+i*32:size+64+i*32]
+      if len(entry) < 32 or struct.unpack("<H", entry[0:2])[0] != 0x02AA:
+        break
+      [offset, partitionSize] = struct.unpack("<II", entry[4:12])
+      name = entry[12:28].split(b"\x00")[0].decode("ascii", "replace")
+      partitions.append(("partition " + name, offset, partitionSize))
+  return (binary, partitions)
+
 class CPXPacket(object):
     """
     A packet with routing and data
@@ -146,8 +370,18 @@ class CPX(object):
   def send(self, packet):
     self._socket.send(packet.wireData)
 
-  def receive(self):
-    header = self._rx_bytes(4)
+  def receive(self, timeout=None):
+    """Returns None if no packet has started to arrive within timeout seconds"""
+    header = bytearray()
+    if timeout is not None:
+      self._socket.settimeout(timeout)
+      try:
+        header.extend(self._socket.recv(4))
+      except socket.timeout:
+        return None
+      finally:
+        self._socket.settimeout(None)
+    header.extend(self._rx_bytes(4 - len(header)))
     packet = CPXPacket(wireHeader=header)
     packet.data = self._rx_bytes(packet.length - 2) # remove routing info here
     return packet
@@ -157,8 +391,15 @@ class CPX(object):
     return self.receive()
 
 class GAP8Bootloader:
+  # Time to wait for a write ACK before asking the GAP8 where it is, and how
+  # many times to ask before giving up. The GAP8 abandons a write after 10 s.
+  ACK_TIMEOUT = 3.0
+  ACK_RETRIES = 5
+
   def __init__(self, cpx):
     self._cpx = cpx
+    self.features = 0
+    self.maxChunkSize = None
 
   def getVersion(self):
     version = self._cpx.transaction(CPXPacket(destination=CPXTarget.GAP8,
@@ -166,17 +407,122 @@ class GAP8Bootloader:
                                               data=bytearray([0x00])))
     return version.data[1:]
 
+  def _command(self, cmd):
+    answer = self._cpx.transaction(CPXPacket(destination=CPXTarget.GAP8,
+                                             function=CPXFunction.BOOTLOADER,
+                                             data=cmd))
+    return answer.data
+
+  def batch(self, cmds):
+    """Run commands that have a single reply with as few round trips as
+       possible, the replies are the same as when running them one by one"""
+    if len(cmds) == 0:
+      return []
+
+    payload = bytearray([0x0E, len(cmds)])
+    for cmd in cmds:
+      payload += struct.pack("<BB", len(cmd) - 1, cmd[0]) + cmd[1:]
+
+    answer = self._command(payload)
+    replies = []
+    offset = 2
+    for _ in range(answer[1]):
+      [cmd, size] = struct.unpack("<BH", answer[offset:offset+3])
+      replies.append(bytes([cmd]) + bytes(answer[offset+3:offset+3+size]))
+      offset += 3 + size
+
+    if len(replies) == 0:
+      raise Exception("GAP8 could not run batched command 0x{:02X}".format(cmds[0][0]))
+    # What didn't fit in the reply is sent in the next batch
+    return replies + self.batch(cmds[len(replies):])
+
+  def getInfo(self):
+    """Returns a dict of the GAP8 capabilities, needs version 2 or later"""
+    answer = self._command(bytearray([0x05]))
+    fields = struct.unpack("<BHHBIIIII", answer[1:27])
+    self.features = fields[7]
+    self.maxChunkSize = fields[2]
+    return dict(zip(["version", "mtu", "maxChunkSize", "windowMax", "sectorSize", "flashSize", "appStart", "features", "appEnd"], fields))
+
+  @staticmethod
+  def eraseCmd(start, size):
+    return struct.pack("<BII", 0x01, start, size)
+
+  def erase(self, start, size):
+    """Erase a range in the application area, the rest of partly covered
+       sectors is kept. Returns (ok, sectors erased, bytes kept, sectors
+       skipped since they were already erased)"""
+    answer = self._command(self.eraseCmd(start, size))
+    [ok, sectors, kept, skipped] = struct.unpack("<BHIH", answer[1:10])
+    return (ok != 0, sectors, kept, skipped)
+
+  def journal(self):
+    """Progress of the latest write as (start, size, done, crc32 of done bytes)"""
+    answer = self._command(bytearray([0x0F]))
+    return struct.unpack("<IIII", answer[1:17])
+
+  @staticmethod
+  def bootConfigCmd(hostWait=None, flags=0):
+    return struct.pack("<BBHB", 0x0A, hostWait is not None, hostWait or 0, flags)
+
+  def bootConfig(self, hostWait=None, flags=0):
+    """Read the boot config, or store it if hostWait is given. Returns (hostWait, flags)"""
+    answer = self._command(self.bootConfigCmd(hostWait, flags))
+    return struct.unpack("<HB", answer[1:4])
+
+  def storeImageDescriptor(self, start, data, algorithm):
+    """Let the GAP8 verify the image against our digest and remember it as
+       verified, returns True if it did"""
+    digest = BLDigest.calculate(algorithm, data)
+    cmd = struct.pack("<BBIIB", 0x0B, 1, start, len(data), algorithm) + digest.ljust(32, b"\x00")
+    answer = self._cpx.transaction(CPXPacket(destination=CPXTarget.GAP8,
+                                             function=CPXFunction.BOOTLOADER,
+                                             data=cmd))
+    [_, size] = struct.unpack("<II", answer.data[1:9])
+    return size == len(data)
+
+  @staticmethod
+  def statsCmd(reset=False):
+    return struct.pack("<BB", 0x0C, reset)
+
+  def stats(self, reset=False):
+    """Returns a list of (name, count, total us, max us) of the counters"""
+    answer = self._cpx.transaction(CPXPacket(destination=CPXTarget.GAP8,
+                                             function=CPXFunction.BOOTLOADER,
+                                             data=self.statsCmd(reset)))
+    names = BLStats.names + ["command 0x{:02X}".format(i) for i in range(BLStats.commands)] + BLStats.added + BLStats.stacks
+    counters = []
+    for i, name in enumerate(names):
+      if len(answer.data) < 13+i*12:
+        break
+      [count, total, maximum] = struct.unpack("<III", answer.data[1+i*12:13+i*12])
+      counters.append((name, count, total, maximum))
+    return counters
+
+  def trace(self, clear=False):
+    """Returns the raw events of the trace"""
+    self._cpx.send(CPXPacket(destination=CPXTarget.GAP8,
+                             function=CPXFunction.BOOTLOADER,
+                             data=struct.pack("<BB", 0x0D, clear)))
+    events = bytearray()
+    while True:
+      answer = self._cpx.receive()
+      if answer.function == CPXFunction.BOOTLOADER and len(answer.data) >= 5 and answer.data[0] == 0x0D:
+        [index, total] = struct.unpack("<HH", answer.data[1:5])
+        events.extend(answer.data[5:])
+        if index + (len(answer.data) - 5) // 8 >= total:
+          return events
+
   def readFlash(self, start, count):
     cmd = struct.pack("<BII", 0x03, start, count)
     readPacket = CPXPacket(destination=CPXTarget.GAP8, function=CPXFunction.BOOTLOADER, data=cmd)
 
     self._cpx.send(readPacket)
-    totalBytesRead = 0
     totalRead = bytearray()
-    while (totalBytesRead < size):
+    while (len(totalRead) < count):
       readAnswer = self._cpx.receive()
-      totalRead.extend(readAnswer.data)
-      totalBytesRead += readAnswer.length
+      if readAnswer.function == CPXFunction.BOOTLOADER:
+        totalRead.extend(readAnswer.data)
     return totalRead
 
   def MD5Flash(self, start, count):
@@ -185,19 +531,38 @@ class GAP8Bootloader:
                                           data=struct.pack("<BII", 0x04, start, count)))
     return md5.data[1:]
 
+  def digestFlash(self, start, count, algorithm, blockSize=0):
+    answer = self._cpx.transaction(CPXPacket(destination=CPXTarget.GAP8,
+                                             function=CPXFunction.BOOTLOADER,
+                                             data=struct.pack("<BIIBH", 0x09, start, count, algorithm, blockSize)))
+    if answer.data[1] != algorithm:
+      raise Exception("GAP8 does not support digest algorithm {}".format(algorithm))
+    return answer.data[2:]
+
+  def MD5MapFlash(self, start, count, blockSize):
+    cmd = struct.pack("<BIII", 0x08, start, count, blockSize)
+    self._cpx.send(CPXPacket(destination=CPXTarget.GAP8, function=CPXFunction.BOOTLOADER, data=cmd))
+
+    nBlocks = (count + blockSize - 1) // blockSize
+    digests = bytearray()
+    while len(digests) < nBlocks * 16:
+      answer = self._cpx.receive()
+      if answer.function == CPXFunction.BOOTLOADER:
+        digests.extend(answer.data)
+    return [bytes(digests[i*16:(i+1)*16]) for i in range(nBlocks)]
+
   def startApplication(self):
     self._cpx.send(CPXPacket(destination=CPXTarget.GAP8,
                             function=CPXFunction.BOOTLOADER,
                             data=struct.pack("<B", 0x06)))
 
-  def writeFlash(self, start, data):
+  def writeFlash(self, start, data, maxChunkSize=512):
     cmd = struct.pack("<BII", 0x02, start, len(data))
     cmdPacket = CPXPacket(destination=CPXTarget.GAP8, function=CPXFunction.BOOTLOADER, data=cmd)
 
     self._cpx.send(cmdPacket)
 
     totalBytesWritten = 0
-    maxChunkSize = 512
     while (totalBytesWritten < len(data)):
       nextChunk = min(maxChunkSize, len(data) - totalBytesWritten)
       print("We're at {}, next chunk is {} bytes".format(totalBytesWritten, nextChunk))
@@ -207,6 +572,181 @@ class GAP8Bootloader:
       self._cpx.send(fwWritePacket)
       totalBytesWritten += nextChunk
 
+  def _receiveWriteAck(self, timeout=None):
+    """Returns None if no ACK arrived within timeout seconds"""
+    while True:
+      answer = self._cpx.receive(timeout)
+      if answer is None:
+        return None
+      if answer.function == CPXFunction.BOOTLOADER and len(answer.data) >= 5 and answer.data[0] == 0x07:
+        return struct.unpack("<HBB", answer.data[1:5]) + (answer.data[5:],)
+
+  def _dataHeader(self):
+    """Chunks are marked as data if the GAP8 supports it, so they can't be taken as commands"""
+    return struct.pack("<B", 0x10) if self.features & BLFeature.WRITE_DATA else b""
+
+  def _writeDone(self, extra):
+    """Strip the erase counts from the final ACK of a write"""
+    if self.features & BLFeature.BLANK_CHECK and len(extra) >= 4:
+      [erased, skipped] = struct.unpack("<HH", extra[0:4])
+      print("Erased {} sectors, {} were already erased".format(erased, skipped))
+      return extra[4:]
+    return extra
+
+  def writeFlashWindowed(self, start, data, window=8, compress=False, verify=None, maxChunkSize=512, sparse=False):
+    """Write data, if verify is a BLDigest the GAP8 reads back what it programs
+       and (verified, digest) of the read back data is returned. Sparse writes
+       don't send or program blank runs and can't be compressed."""
+    flags = 0
+    if verify is not None:
+      flags |= 0x02
+    size = len(data)
+    if compress:
+      flags |= 0x01
+      data = lzCompress(data)
+      print("Compressed {} bytes to {} bytes ({:.1f}%)".format(size, len(data), 100.0 * len(data) / max(size, 1)))
+      chunks = [data[i:i+maxChunkSize] for i in range(0, len(data), maxChunkSize)]
+    elif sparse:
+      flags |= 0x08
+      chunks = sparseChunks(bytes(data), maxChunkSize)
+      sent = sum([len(chunk) for chunk in chunks])
+      print("Sparse write of {} bytes in {} bytes ({:.1f}%)".format(size, sent, 100.0 * sent / max(size, 1)))
+    else:
+      chunks = [data[i:i+maxChunkSize] for i in range(0, len(data), maxChunkSize)]
+
+    cmd = struct.pack("<BIIBBB", 0x07, start, size, window, flags, verify if verify is not None else BLDigest.NONE)
+    self._cpx.send(CPXPacket(destination=CPXTarget.GAP8, function=CPXFunction.BOOTLOADER, data=cmd))
+
+    # The first ACK tells us the window the GAP8 will accept
+    ack = self._receiveWriteAck(self.ACK_TIMEOUT)
+    if ack is None:
+      raise Exception("GAP8 didn't answer the write command")
+    [_, status, window, _] = ack
+    if status == BLWriteStatus.UNSUPPORTED:
+      raise BLWriteRefused("GAP8 can't do a write with flags 0x{:02X}".format(flags))
+
+    acked = 0
+    nextChunk = 0
+    timeouts = 0
+    while status != BLWriteStatus.DONE:
+      while nextChunk < len(chunks) and nextChunk - acked < window:
+        payload = self._dataHeader() + struct.pack("<H", nextChunk & 0xFFFF) + chunks[nextChunk]
+        self._cpx.send(CPXPacket(destination=CPXTarget.GAP8,
+                                 function=CPXFunction.BOOTLOADER,
+                                 data=payload))
+        nextChunk += 1
+
+      ack = self._receiveWriteAck(self.ACK_TIMEOUT)
+      if ack is None:
+        # The last chunks or their ACK were lost, an empty chunk with the
+        # report sequence number is answered with where to resend from
+        timeouts += 1
+        if timeouts > self.ACK_RETRIES or not self.features & BLFeature.WRITE_DATA:
+          raise Exception("No ACK from the GAP8 after {} chunks".format(acked))
+        self._cpx.send(CPXPacket(destination=CPXTarget.GAP8,
+                                 function=CPXFunction.BOOTLOADER,
+                                 data=self._dataHeader() + struct.pack("<H", 0xFFFF)))
+        continue
+      timeouts = 0
+      [seq, status, window, extra] = ack
+      # Sequence numbers are 16 bits on the wire, acks are cumulative
+      acked += (seq - acked) & 0xFFFF
+      print("We're at {}, {} chunks acknowledged".format(min(acked * maxChunkSize, len(data)), acked))
+
+      if status == BLWriteStatus.OUT_OF_ORDER:
+        print("GAP8 lost chunk {}, resending from there".format(acked))
+        nextChunk = acked
+      elif status == BLWriteStatus.OVERFLOW:
+        raise Exception("GAP8 received more data than announced")
+      elif status == BLWriteStatus.CORRUPT:
+        raise Exception("GAP8 could not decode the compressed data")
+
+    extra = self._writeDone(extra)
+    if verify is not None and len(extra) >= 2:
+      return (extra[0] != 0, bytes(extra[2:]))
+    return None
+
+  def crcChunkSizeMax(self):
+    """Max data in a chunk of a CRC write. The max chunk size in the info is
+       for chunks with a data marker and sequence number, CRC chunks also have
+       a CRC and an offset."""
+    return self.maxChunkSize - 4 - 4
+
+  def writeFlashCrc(self, start, data, window=8, maxChunkSize=None):
+    """Write with a CRC in every chunk, only the chunks that are damaged or
+       lost on the way are sent again. The chunks are as large as the GAP8
+       allows unless maxChunkSize is given."""
+    if maxChunkSize is None:
+      maxChunkSize = self.crcChunkSizeMax()
+    chunks = [data[i:i+maxChunkSize] for i in range(0, len(data), maxChunkSize)]
+    cmd = struct.pack("<BIIBBBH", 0x07, start, len(data), window, 0x04, BLDigest.NONE, maxChunkSize)
+    self._cpx.send(CPXPacket(destination=CPXTarget.GAP8, function=CPXFunction.BOOTLOADER, data=cmd))
+
+    ack = self._receiveWriteAck(self.ACK_TIMEOUT)
+    if ack is None:
+      raise Exception("GAP8 didn't answer the write command")
+    [_, status, window, _] = ack
+    if status == BLWriteStatus.UNSUPPORTED:
+      raise BLWriteRefused("GAP8 can't do a CRC write of {} chunks".format(len(chunks)))
+
+    def sendChunk(seq, chunk, offset, crc=None):
+      header = struct.pack("<HI", seq, offset)
+      if crc is None:
+        crc = zlib.crc32(header + chunk) & 0xFFFFFFFF
+      self._cpx.send(CPXPacket(destination=CPXTarget.GAP8,
+                               function=CPXFunction.BOOTLOADER,
+                               data=self._dataHeader() + struct.pack("<I", crc) + header + chunk))
+
+    # A chunk is only resent when a report, asked for after the chunk was
+    # sent, says it's missing. The link keeps the order so the report covers
+    # everything sent before it, and no chunk is ever sent twice while a copy
+    # of it can still arrive.
+    toSend = list(range(len(chunks)))
+    lastSent = [0] * len(chunks)
+    sent = 0
+    acked = 0
+    resent = 0
+    reportMark = None
+    timeouts = 0
+    while status != BLWriteStatus.DONE:
+      while len(toSend) > 0 and toSend[0] < acked + window:
+        seq = toSend.pop(0)
+        sent += 1
+        lastSent[seq] = sent
+        sendChunk(seq, chunks[seq], seq * maxChunkSize)
+
+      # If chunks were lost no more ACKs will come once the window is full
+      blocked = len(toSend) == 0 or toSend[0] >= acked + window
+      if reportMark is None and (blocked or status == BLWriteStatus.BAD_CRC):
+        sendChunk(0xFFFF, b"", 0, 0xFFFFFFFF)
+        reportMark = sent
+
+      ack = self._receiveWriteAck(self.ACK_TIMEOUT)
+      if ack is None:
+        # The report or the chunks before it were lost, ask again
+        timeouts += 1
+        if timeouts > self.ACK_RETRIES:
+          raise Exception("No ACK from the GAP8 after {} chunks".format(acked))
+        sendChunk(0xFFFF, b"", 0, 0xFFFFFFFF)
+        reportMark = sent
+        continue
+      timeouts = 0
+      [seq, status, window, extra] = ack
+      acked = max(acked, seq)
+
+      if status == BLWriteStatus.GAPS:
+        for i in range(len(extra) * 8):
+          if extra[i // 8] & (1 << (i % 8)) and seq + i < len(chunks) and lastSent[seq + i] <= reportMark and seq + i not in toSend:
+            toSend.append(seq + i)
+            resent += 1
+        toSend.sort()
+        reportMark = None
+      print("We're at {}, {} chunks acknowledged".format(min(acked * maxChunkSize, len(data)), acked))
+
+    self._writeDone(extra)
+    if resent > 0:
+      print("Resent {} damaged or lost chunks".format(resent))
+
 class ESP32System:
   def __init__(self, cpx):
     self._cpx = cpx
@@ -243,21 +783,198 @@ version = bootloader.getVersion()
 print("GAP8 bootloader is version 0x{:02X}".format(version[0]))
 
 flashAppStart = 0x40000
+flashAppEnd = None
+flashPageSize = 0x40000
+maxChunkSize = 512
+
+if version[0] >= 2:
+  info = bootloader.getInfo()
+  features = info["features"]
+  flashAppStart = info["appStart"]
+  flashPageSize = info["sectorSize"]
+  flashAppEnd = info["appEnd"]
+  # Fill the packets, less the CPX header, the data marker and the sequence number
+  maxChunkSize = min(info["maxChunkSize"], 1022 - 2 - (1 if features & BLFeature.WRITE_DATA else 0) - 2)
+  print("GAP8 has {} byte sectors, {} MB flash, max {} byte chunks".format(flashPageSize, info["flashSize"] // 1024 // 1024, maxChunkSize))
+else:
+  features = 0
+
+# Setup commands are sent in one batch if the GAP8 supports it
+setup = []
+
+printStats = printStats and features & BLFeature.STATS
+if printStats:
+  setup.append(GAP8Bootloader.statsCmd(reset=True))
+
+if autoBootWait is not None and features & BLFeature.BOOT_CONFIG:
+  if autoBootWait < 0:
+    setup.append(GAP8Bootloader.bootConfigCmd(0, 0))
+    print("Auto boot disabled")
+  else:
+    setup.append(GAP8Bootloader.bootConfigCmd(autoBootWait, 0x01))
+    print("Auto boot after {} ms without host".format(autoBootWait))
+
+if features & BLFeature.BATCH:
+  bootloader.batch(setup)
+else:
+  for cmd in setup:
+    bootloader._command(cmd)
+
+traceName = traceName if features & BLFeature.TRACE else None
+if traceName is not None:
+  bootloader.trace(clear=True)
+
+if dumpSize is not None:
+  print("Reading {} bytes from flash...".format(dumpSize))
+  readStart = time.time()
+  dump = bootloader.readFlash(flashAppStart, dumpSize)
+  readTime = time.time() - readStart
+  with open(imageName, "wb") as f:
+    f.write(dump)
+  print("Read {} bytes in {:.1f}s ({:.2f} MB/s) to {}".format(len(dump), readTime, len(dump) / readTime / 1e6, imageName))
+  sys.exit(0)
 
 fw = bytearray()
 with open(imageName, "rb") as f:
   fw.extend(f.read())
 
 print("Firmware is {} bytes".format(len(fw)))
+if flashAppEnd is not None and flashAppStart + len(fw) > flashAppEnd:
+  print("Firmware doesn't fit, the flash from 0x{:X} is reserved for the bootloader".format(flashAppEnd))
+  sys.exit(1)
+if flashAppEnd is not None:
+  # The image header and partitions must also keep out of the metadata, the
+  # GAP8 doesn't boot an image whose header reaches into it
+  (binary, partitions) = imageLayout(fw)
+  for (name, offset, size) in binary + partitions:
+    if flashAppStart + offset + size > flashAppEnd:
+      print("The {} ends at 0x{:X}, the flash from 0x{:X} is reserved for the bootloader".format(name, flashAppStart + offset + size, flashAppEnd))
+      if (name, offset, size) in binary:
+        sys.exit(1)
 fwMD5 = hashlib.md5(fw)
 print("MD5: {}".format(fwMD5.hexdigest()))
-bootloader.writeFlash(flashAppStart, fw)
-
-gap8CalcMD5 = bootloader.MD5Flash(flashAppStart, len(fw))
-print(binascii.hexlify(gap8CalcMD5))
-
-if gap8CalcMD5 == fwMD5.digest():
-  print("Flash OK: Firmware MD5 matches!")
+def changedPages(bootloader, start, data):
+  """Return (offset, size) of the runs of flash pages that differ from data"""
+  remote = bootloader.MD5MapFlash(start, len(data), flashPageSize)
+  runs = []
+  for i, digest in enumerate(remote):
+    page = data[i*flashPageSize:(i+1)*flashPageSize]
+    if hashlib.md5(page).digest() == digest:
+      continue
+    if len(runs) > 0 and runs[-1][0] + runs[-1][1] == i * flashPageSize:
+      runs[-1] = (runs[-1][0], runs[-1][1] + len(page))
+    else:
+      runs.append((i * flashPageSize, len(page)))
+  return runs
+
+# With WRITE_VERIFY the GAP8 digests the data as it's programmed, so each written
+# run is verified without reading the flash again
+verify = BLDigest.byName[digestName] if features & BLFeature.WRITE_VERIFY else None
+writeVerified = verify is not None
+
+crcChunks = crcChunks and features & BLFeature.WRITE_CRC
+if crcChunks:
+  # Can't be combined with compression or verifying while writing
+  verify = None
+  writeVerified = False
+
+def writeRun(offset, size):
+  global writeVerified
+  if features & BLFeature.JOURNAL:
+    # An update that was cut off continues after the last completed sector
+    [start, total, done, crc] = bootloader.journal()
+    if start == flashAppStart + offset and total == size and 0 < done < size and crc == zlib.crc32(fw[offset:offset+done]) & 0xFFFFFFFF:
+      print("Resuming interrupted write of {}@0x{:X} after {} bytes".format(size, start, done))
+      offset += done
+      size -= done
+      # Only the rest is verified while writing
+      writeVerified = False
+  start = flashAppStart + offset
+  data = fw[offset:offset+size]
+  try:
+    writeData(start, data)
+  except BLWriteRefused:
+    # The GAP8 only keeps a few KiB of the sectors a write partly covers, so
+    # the rest of them is read back and written with the run
+    (start, data) = wholeSectors(start, data)
+    print("Writing whole sectors, {}@0x{:X}".format(len(data), start))
+    writeData(start, data)
+
+def wholeSectors(start, data):
+  """Extend a write to the start and end of the sectors it covers, with what
+     is in flash"""
+  end = start + len(data)
+  sectorStart = start // flashPageSize * flashPageSize
+  sectorEnd = (end + flashPageSize - 1) // flashPageSize * flashPageSize
+  if flashAppEnd is not None:
+    sectorEnd = min(sectorEnd, flashAppEnd)
+  head = bootloader.readFlash(sectorStart, start - sectorStart) if start > sectorStart else b""
+  tail = bootloader.readFlash(end, sectorEnd - end) if sectorEnd > end else b""
+  return (sectorStart, bytes(head) + bytes(data) + bytes(tail))
+
+def writeData(start, data):
+  global writeVerified
+  if crcChunks:
+    bootloader.writeFlashCrc(start, data, window)
+    return
+  # Blank runs are only skipped when not compressing, the compression takes
+  # care of them in the data sent
+  useLz = compress and features & BLFeature.LZ
+  sparse = not useLz and features & BLFeature.SPARSE
+  result = bootloader.writeFlashWindowed(start, data, window, useLz, verify, maxChunkSize, sparse)
+  if verify is not None:
+    if result is None or not result[0] or result[1] != BLDigest.calculate(verify, data):
+      print("Write verification of {}@0x{:X} failed".format(len(data), start))
+      writeVerified = False
+
+if features & BLFeature.HASHMAP and not fullWrite:
+  runs = changedPages(bootloader, flashAppStart, fw)
+  changed = sum([size for (_, size) in runs])
+  print("{} of {} bytes differ from what is in flash".format(changed, len(fw)))
+  for (offset, size) in runs:
+    writeRun(offset, size)
+elif features & BLFeature.WRITE_WINDOWED:
+  writeRun(0, len(fw))
+else:
+  bootloader.writeFlash(flashAppStart, fw, maxChunkSize)
+
+if writeVerified:
+  # Unchanged pages were compared by the hash map, written ones while writing
+  fwDigest = gap8Digest = BLDigest.calculate(verify, fw)
+elif features & BLFeature.DIGEST:
+  algorithm = BLDigest.byName[digestName]
+  fwDigest = BLDigest.calculate(algorithm, fw)
+  verifyStart = time.time()
+  gap8Digest = bootloader.digestFlash(flashAppStart, len(fw), algorithm)
+  print("{}: {} (verified in {:.1f}s)".format(digestName.upper(), binascii.hexlify(gap8Digest), time.time() - verifyStart))
+else:
+  digestName = "md5"
+  fwDigest = fwMD5.digest()
+  gap8Digest = bootloader.MD5Flash(flashAppStart, len(fw))
+  print(binascii.hexlify(gap8Digest))
+
+if printStats:
+  print("{:<16} {:>8} {:>12} {:>10}".format("counter", "count", "total [us]", "max [us]"))
+  counters = bootloader.stats()
+  for (name, count, total, maximum) in counters:
+    if count > 0 and name not in BLStats.stacks:
+      print("{:<16} {:>8} {:>12} {:>10}".format(name, count, total, maximum))
+  for (name, size, _, used) in counters:
+    if size > 0 and name in BLStats.stacks:
+      print("{:<16} {:>8} of {} bytes used".format(name, used, size))
+
+if traceName is not None:
+  with open(traceName, "wb") as f:
+    f.write(bootloader.trace())
+  print("Trace saved to {}".format(traceName))
+
+if gap8Digest == fwDigest:
+  print("Flash OK: Firmware {} matches!".format(digestName.upper()))
+  if features & BLFeature.IMAGE:
+    if bootloader.storeImageDescriptor(flashAppStart, fw, BLDigest.byName[digestName]):
+      print("Image marked as verified")
+    else:
+      print("GAP8 failed to verify the image, it will not be booted automatically")
   bootloader.startApplication()
 else:
-  print("Flash FAIL: Firmware MD5 does NOT match!")
+  print("Flash FAIL: Firmware {} does NOT match!".format(digestName.upper()))
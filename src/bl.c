@@ -27,9 +27,13 @@
 
 #include "pmsis.h"
 
-#include "bsp/crc/md5.h"
-
 #include "flash.h"
+#include "erase.h"
+#include "lz.h"
+#include "digest.h"
+#include "meta.h"
+#include "crc32.h"
+#include "trace.h"
 #include "bl.h"
 #include "cpx.h"
 
@@ -39,162 +43,1323 @@
 #define DEBUG_PRINTF(...) ((void) 0)
 #endif /* DEBUG */
 
-#define SIZE_OF_MD5_BUFER (512)
-
-#define PAGE_SIZE (0x40000)
 #define FIRMWARE_START_ADDRESS (PAGE_SIZE * 1)
 
+#define MAX_NB_SEGMENT 16
+
+typedef struct {
+  uint32_t offset;
+  uint32_t base;
+  uint32_t size;
+  uint32_t nBlocks;
+} bin_segment_t;
+
+typedef struct {
+  uint32_t size;
+  uint32_t nSegments;
+  uint32_t entry;
+  uint32_t entryBase;
+  bin_segment_t segments[MAX_NB_SEGMENT];
+} bin_header_t;
+
+static bin_header_t header;
+
 uint16_t bl_handleVersionCommand(VersionOut_t * out) {
-  out->version = 1;
+  out->version = BL_VERSION;
 
   return 1;
 }
 
-void bl_handleReadCommand(ReadIn_t * info,  CPXPacket_t * txp) {
+uint16_t bl_handleInfoCommand(InfoOut_t * out) {
+  out->version = BL_VERSION;
+  out->mtu = MTU;
+  out->maxChunkSize = sizeof(((WriteChunk_t *) 0)->data);
+  out->windowMax = BL_WRITE_WINDOW_MAX;
+  out->sectorSize = flash_sector_size();
+  out->flashSize = FLASH_SIZE;
+  out->appStart = FIRMWARE_START_ADDRESS;
+  out->appEnd = META_ADDRESS;
+  out->features = BL_FEATURE_WRITE_WINDOWED | BL_FEATURE_HASHMAP | BL_FEATURE_LZ |
+                  BL_FEATURE_DIGEST | BL_FEATURE_WRITE_VERIFY | BL_FEATURE_BOOT_CONFIG |
+                  BL_FEATURE_IMAGE | BL_FEATURE_STATS | BL_FEATURE_TRACE | BL_FEATURE_BATCH |
+                  BL_FEATURE_WRITE_CRC | BL_FEATURE_JOURNAL | BL_FEATURE_SPARSE | BL_FEATURE_ERASE |
+                  BL_FEATURE_BLANK_CHECK | BL_FEATURE_WRITE_DATA;
+
+  return sizeof(InfoOut_t);
+}
+
+uint16_t bl_handleStatsCommand(StatsIn_t * info, StatsOut_t * out) {
+  stats_get(out->entries, info->reset);
+
+  return sizeof(StatsOut_t);
+}
+
+void bl_handleTraceCommand(TraceIn_t * info, const CPXRouting_t * route) {
+  uint32_t total;
+  uint32_t index = 0;
+
+  // Reading out the trace would otherwise fill it with its own events
+  trace_enable(false);
+  total = trace_count();
+
+  do {
+    CPXPacket_t * txp = bl_allocReply(route);
+    BLPacket_t * blpTx = (BLPacket_t*) txp->data;
+    TraceOut_t * out = (TraceOut_t*) blpTx->data;
+    uint32_t count = (sizeof(blpTx->data) - sizeof(TraceOut_t)) / sizeof(trace_event_t);
+
+    count = trace_read(index, out->events, count);
+    blpTx->cmd = BL_CMD_TRACE;
+    out->index = index;
+    out->total = total;
+    index += count;
+
+    cpxSendPacketBlocking(txp, sizeof(BLCommand_t) + sizeof(TraceOut_t) + count * sizeof(trace_event_t));
+  } while (index < total);
+
+  if (info->clear) {
+    trace_clear();
+  }
+  trace_enable(true);
+}
+
+// Largest reply of the commands that can be batched
+#define BATCH_REPLY_MAX (sizeof(StatsOut_t))
+
+// Run one command of a batch, returns the size of the reply or 0 if the
+// command doesn't have a single reply
+static uint16_t handle_batch_entry(BLCommand_t cmd, uint8_t * in, uint8_t * out) {
+  switch (cmd) {
+    case BL_CMD_VERSION:
+      return bl_handleVersionCommand((VersionOut_t *) out);
+    case BL_CMD_INFO:
+      return bl_handleInfoCommand((InfoOut_t *) out);
+    case BL_CMD_MD5:
+      return bl_handleMD5Command((ReadIn_t *) in, (MD5Out_t *) out);
+    case BL_CMD_DIGEST:
+      return bl_handleDigestCommand((DigestIn_t *) in, (DigestOut_t *) out);
+    case BL_CMD_BOOT_CONFIG:
+      return bl_handleBootConfigCommand((BootConfigIn_t *) in, (BLBootConfig_t *) out);
+    case BL_CMD_IMAGE:
+      return bl_handleImageCommand((ImageIn_t *) in, (BLImageDescriptor_t *) out);
+    case BL_CMD_STATS:
+      return bl_handleStatsCommand((StatsIn_t *) in, (StatsOut_t *) out);
+    case BL_CMD_JOURNAL:
+      return bl_handleJournalCommand((BLWriteJournal_t *) out);
+    case BL_CMD_ERASEPAGE:
+      return bl_handleEraseCommand((ReadIn_t *) in, (EraseOut_t *) out);
+    default:
+      return 0;
+  }
+}
+
+// Input of a batched command, large enough for any of them
+typedef union {
+  ReadIn_t read;
+  DigestIn_t digest;
+  BootConfigIn_t bootConfig;
+  ImageIn_t image;
+  StatsIn_t stats;
+} batch_entry_in_t;
+
+uint16_t bl_handleBatchCommand(BatchIn_t * info, BatchOut_t * out) {
+  // Each command gets its own zeroed input, like a command in its own packet,
+  // and replies straight into the reply as there is room for any reply
+  static batch_entry_in_t entryIn;
+  const uint32_t inSize = sizeof(((BLPacket_t *) 0)->data) - sizeof(BatchIn_t);
+  const uint32_t outSize = sizeof(((BLPacket_t *) 0)->data) - sizeof(BatchOut_t);
+  uint32_t inOffset = 0;
+  uint32_t outOffset = 0;
+  uint8_t count = 0;
+
+  while (count < info->count && inOffset + sizeof(BatchEntryIn_t) <= inSize) {
+    BatchEntryIn_t * entry = (BatchEntryIn_t *) &info->entries[inOffset];
+    BatchEntryOut_t * reply = (BatchEntryOut_t *) &out->entries[outOffset];
+
+    if (inOffset + sizeof(BatchEntryIn_t) + entry->size > inSize) {
+      break;
+    }
+
+    // A reply that doesn't fit would have to be run again, so stop before
+    // running anything that could need more space than is left
+    if (outOffset + sizeof(BatchEntryOut_t) + BATCH_REPLY_MAX > outSize) {
+      break;
+    }
+
+    memset(&entryIn, 0, sizeof(entryIn));
+    memcpy(&entryIn, entry->data, entry->size < sizeof(entryIn) ? entry->size : sizeof(entryIn));
+
+    DEBUG_PRINTF("Batched command [0x%02X]\n", entry->cmd);
+    trace_log(TRACE_CMD_START, entry->cmd, 0);
+    uint16_t replySize = handle_batch_entry(entry->cmd, (uint8_t *) &entryIn, reply->data);
+    trace_log(TRACE_CMD_END, entry->cmd, 0);
+
+    reply->cmd = entry->cmd;
+    reply->size = replySize;
+
+    inOffset += sizeof(BatchEntryIn_t) + entry->size;
+    outOffset += sizeof(BatchEntryOut_t) + replySize;
+    count++;
+  }
+
+  out->count = count;
+
+  return sizeof(BatchOut_t) + outOffset;
+}
+
+CPXPacket_t * bl_allocReply(const CPXRouting_t * route) {
+  CPXPacket_t * txp = cpxAllocPacket();
+  txp->route = *route;
+  return txp;
+}
+
+void bl_handleReadCommand(ReadIn_t * info, const CPXRouting_t * route) {
+  static flash_request_t readRequest;
   uint32_t sizeLeft;
   uint32_t currentBaseAddress;
   uint32_t chunkSize;
+  CPXPacket_t * txp;
 
   sizeLeft = info->size;
   currentBaseAddress = info->start;
-  chunkSize = 0;
 
   DEBUG_PRINTF("Size left = %u, currentBase=0x%X\n", sizeLeft, currentBaseAddress);
-  do {
-    chunkSize = sizeLeft < sizeof(txp->data) ? sizeLeft : sizeof(txp->data);
-    //printf("Reading chunk of %u\n", chunkSize);
-    flash_read(currentBaseAddress, txp->data, chunkSize);
-    //printf("have read flash\n");
 
-    //printf("%02X->%02X (%02X)\n", txp->route.source, txp->route.destination, txp->route.function);
+  // The next chunk is read from flash while the previous one is being sent
+  txp = bl_allocReply(route);
+  chunkSize = sizeLeft < sizeof(txp->data) ? sizeLeft : sizeof(txp->data);
+  flash_read_submit(&readRequest, currentBaseAddress, txp->data, chunkSize);
 
-    //printf("sendin data\n");
-    cpxSendPacketBlocking(txp, chunkSize);
-    //printf("have sent data\n");
+  do {
+    flash_request_wait(&readRequest);
 
     currentBaseAddress += chunkSize;
     sizeLeft -= chunkSize;
-    //printf("Size left = %u, currentBase=0x%X\n", sizeLeft, currentBaseAddress);
+
+    // Queued before the next packet is taken from the pool, the read of the
+    // next chunk still overlaps sending the ones in the queue
+    cpxSendPacketBlocking(txp, chunkSize);
+
+    if (sizeLeft > 0) {
+      txp = bl_allocReply(route);
+      chunkSize = sizeLeft < sizeof(txp->data) ? sizeLeft : sizeof(txp->data);
+      flash_read_submit(&readRequest, currentBaseAddress, txp->data, chunkSize);
+    }
   } while (sizeLeft > 0);
   DEBUG_PRINTF("Read completed\n");
 }
 
-static uint8_t buffer[SIZE_OF_MD5_BUFER];
-static MD5_CTX ctx;
+// These must be in L2 for uDMA to work
+static uint8_t digestBuffers[2][BL_DIGEST_BLOCK_MAX];
+static digest_ctx_t ctx;
 
-uint32_t bl_handleMD5Command(ReadIn_t * info, MD5Out_t * dataout) {
+// Calculate the digest of an area in flash, reading the next block while
+// hashing the previous one
+static uint32_t digest_range(digest_algorithm_t algorithm, uint32_t start, uint32_t size, uint32_t blockSize, uint8_t * digest) {
+  static flash_request_t readRequest;
   uint32_t sizeLeft;
   uint32_t currentBaseAddress;
   uint32_t chunkSize;
+  int current;
+
+  if (!digest_init(&ctx, algorithm)) {
+    return 0;
+  }
+
+  if (blockSize == 0 || blockSize > BL_DIGEST_BLOCK_MAX) {
+    blockSize = BL_DIGEST_BLOCK_DEFAULT;
+  }
+
+  sizeLeft = size;
+  currentBaseAddress = start;
+  current = 0;
+
+  chunkSize = sizeLeft < blockSize ? sizeLeft : blockSize;
+  if (sizeLeft > 0) {
+    flash_read_submit(&readRequest, currentBaseAddress, digestBuffers[current], chunkSize);
+  }
+
+  while (sizeLeft > 0) {
+    flash_request_wait(&readRequest);
+
+    uint8_t * data = digestBuffers[current];
+    uint32_t dataSize = chunkSize;
+
+    currentBaseAddress += chunkSize;
+    sizeLeft -= chunkSize;
+
+    if (sizeLeft > 0) {
+      current ^= 1;
+      chunkSize = sizeLeft < blockSize ? sizeLeft : blockSize;
+      flash_read_submit(&readRequest, currentBaseAddress, digestBuffers[current], chunkSize);
+    }
+
+    digest_update(&ctx, data, dataSize);
+  }
 
-  MD5_Init(&ctx);
+  return digest_final(&ctx, digest);
+}
+
+uint32_t bl_handleMD5Command(ReadIn_t * info, MD5Out_t * dataout) {
+  DEBUG_PRINTF("Calculating MD5 for %u bytes @ 0x%X\n", info->size, info->start);
+
+  digest_range(DIGEST_MD5, info->start, info->size, 0, dataout->md5);
+
+  return sizeof(MD5Out_t);
+}
+
+uint32_t bl_handleDigestCommand(DigestIn_t * info, DigestOut_t * dataout) {
+  DEBUG_PRINTF("Calculating digest %u for %u bytes @ 0x%X\n", info->algorithm, info->size, info->start);
+
+  uint32_t digestSize = digest_range(info->algorithm, info->start, info->size, info->blockSize, dataout->digest);
+  dataout->algorithm = digestSize > 0 ? info->algorithm : DIGEST_NONE;
+
+  return sizeof(digest_algorithm_t) + digestSize;
+}
+
+void bl_handleHashMapCommand(HashMapIn_t * info, const CPXRouting_t * route) {
+  CPXPacket_t * txp = NULL;
+  uint32_t sizeLeft;
+  uint32_t currentBaseAddress;
+  uint32_t blockSize;
+  uint32_t packetSize;
 
   sizeLeft = info->size;
   currentBaseAddress = info->start;
-  chunkSize = 0;
+  blockSize = info->blockSize > 0 ? info->blockSize : PAGE_SIZE;
+  packetSize = 0;
 
-  DEBUG_PRINTF("Calculating MD5 for %u bytes @ 0x%X\n", sizeLeft, currentBaseAddress);
+  DEBUG_PRINTF("Calculating MD5 map for %u bytes @ 0x%X in blocks of %u\n", sizeLeft, currentBaseAddress, blockSize);
+
+  // The digests are streamed back like a read, filling up each packet
+  while (sizeLeft > 0) {
+    uint32_t chunkSize = sizeLeft < blockSize ? sizeLeft : blockSize;
+
+    if (txp == NULL) {
+      txp = bl_allocReply(route);
+    }
+    digest_range(DIGEST_MD5, currentBaseAddress, chunkSize, 0, &txp->data[packetSize]);
+    packetSize += sizeof(MD5Out_t);
 
-  do {
-    chunkSize = sizeLeft < SIZE_OF_MD5_BUFER ? sizeLeft : SIZE_OF_MD5_BUFER;
-    flash_read(currentBaseAddress, buffer, chunkSize);
-    MD5_Update(&ctx, buffer, chunkSize);    
     currentBaseAddress += chunkSize;
     sizeLeft -= chunkSize;
-  } while (sizeLeft > 0);
 
-  MD5_Final(dataout->md5, &ctx);
+    if (sizeLeft == 0 || packetSize + sizeof(MD5Out_t) > sizeof(txp->data)) {
+      cpxSendPacketBlocking(txp, packetSize);
+      txp = NULL;
+      packetSize = 0;
+    }
+  }
+  DEBUG_PRINTF("MD5 map completed\n");
+}
 
-  return sizeof(MD5Out_t);
+static bool read_image_descriptor(BLImageDescriptor_t * image) {
+  return meta_read(META_TYPE_IMAGE, image, sizeof(BLImageDescriptor_t)) && image->size > 0;
+}
+
+static bool image_valid(void) {
+  BLImageDescriptor_t image;
+  return read_image_descriptor(&image);
 }
 
-void bl_handleWriteCommand(ReadIn_t * info,  CPXPacket_t * rxp, CPXPacket_t * txp) {
+// Digest of the last write that was read back and checked as it was
+// programmed, an image written in one such write isn't hashed again. Anything
+// written after it makes it stale.
+static uint32_t verifiedStart;
+static uint32_t verifiedSize;
+static digest_algorithm_t verifiedAlgorithm;
+static uint32_t verifiedDigestSize;
+static uint8_t verifiedDigest[DIGEST_MAX_SIZE];
+
+// Anything written to the application area has to be verified again before
+// it's booted automatically
+static void invalidate_image(uint32_t start, uint32_t size) {
+  verifiedSize = 0;
+
+  if (start + size > FIRMWARE_START_ADDRESS && start < META_ADDRESS && image_valid()) {
+    BLImageDescriptor_t image = {.size = 0};
+    DEBUG_PRINTF("Application image is no longer valid\n");
+    meta_write(META_TYPE_IMAGE, &image, sizeof(image));
+  }
+}
+
+// The header must describe segments inside the image, imageSize is 0 if it's
+// not known. Neither the image nor what the header says it takes may reach
+// into the metadata, it would be overwritten by the next log record.
+static bool header_ok(const bin_header_t * header, uint32_t imageSize) {
+  const uint32_t appSize = META_ADDRESS - FIRMWARE_START_ADDRESS;
+
+  if (header->nSegments == 0 || header->nSegments > MAX_NB_SEGMENT) {
+    return false;
+  }
+
+  if (imageSize > appSize || header->size > appSize) {
+    DEBUG_PRINTF("Image of %u bytes (header says %u) reaches into the metadata\n", imageSize, header->size);
+    return false;
+  }
+
+  for (unsigned int i = 0; i < header->nSegments; i++) {
+    const bin_segment_t * segment = &header->segments[i];
+    if (segment->offset > appSize || segment->size > appSize - segment->offset) {
+      return false;
+    }
+    if (imageSize > 0 && (segment->offset > imageSize || segment->size > imageSize - segment->offset)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static uint32_t header_crc(const bin_header_t * header) {
+  uint32_t size = offsetof(bin_header_t, segments) + header->nSegments * sizeof(bin_segment_t);
+  return crc32_update(0, (const uint8_t *) header, size);
+}
+
+uint16_t bl_handleBootConfigCommand(BootConfigIn_t * info, BLBootConfig_t * out) {
+  if (info->set) {
+    meta_write(META_TYPE_BOOT_CONFIG, &info->config, sizeof(info->config));
+  }
+
+  if (!meta_read(META_TYPE_BOOT_CONFIG, out, sizeof(BLBootConfig_t))) {
+    memset(out, 0, sizeof(BLBootConfig_t));
+  }
+
+  return sizeof(BLBootConfig_t);
+}
+
+// The image is hashed once here, so booting only has to check the header
+// against the descriptor. If it was written by one verified write the digest
+// from that is used instead.
+uint16_t bl_handleImageCommand(ImageIn_t * info, BLImageDescriptor_t * out) {
+  if (info->set) {
+    BLImageDescriptor_t image = {.size = 0};
+    uint8_t digest[DIGEST_MAX_SIZE];
+    uint32_t digestSize;
+
+    if (verifiedSize > 0 && verifiedStart == info->start && verifiedSize == info->size &&
+        verifiedAlgorithm == info->algorithm) {
+      DEBUG_PRINTF("Image of %u bytes @ 0x%X was verified when written\n", info->size, info->start);
+      memcpy(digest, verifiedDigest, sizeof(digest));
+      digestSize = verifiedDigestSize;
+    } else {
+      DEBUG_PRINTF("Verifying image of %u bytes @ 0x%X\n", info->size, info->start);
+      digestSize = digest_range(info->algorithm, info->start, info->size, 0, digest);
+    }
+    flash_read(info->start, (uint8_t *) &header, sizeof(bin_header_t));
+
+    if (info->start == FIRMWARE_START_ADDRESS && digestSize > 0 &&
+        memcmp(digest, info->digest, digestSize) == 0 && header_ok(&header, info->size)) {
+      image.start = info->start;
+      image.size = info->size;
+      image.algorithm = info->algorithm;
+      memcpy(image.digest, digest, sizeof(image.digest));
+      image.headerCrc = header_crc(&header);
+      image.entry = header.entry;
+      image.nSegments = header.nSegments;
+    } else {
+      DEBUG_PRINTF("Image verification failed\n");
+    }
+    meta_write(META_TYPE_IMAGE, &image, sizeof(image));
+  }
+
+  if (!read_image_descriptor(out)) {
+    memset(out, 0, sizeof(BLImageDescriptor_t));
+  }
+
+  return sizeof(BLImageDescriptor_t);
+}
+
+uint32_t bl_autoBootWait(void) {
+  BLBootConfig_t config;
+
+  if (!meta_read(META_TYPE_BOOT_CONFIG, &config, sizeof(config)) ||
+      (config.flags & BL_BOOT_FLAG_AUTO) == 0 || !image_valid()) {
+    return BL_HOST_WAIT_FOREVER;
+  }
+
+  return config.hostWait;
+}
+
+// Chunks are copied to the write combining buffers of the flash, which are
+// programmed in whole write buffers while the next chunks are received
+
+// When verifying, each program is read back once it has completed and the
+// digest is calculated on what was read, so the write doesn't have to be re-read
+static bool verifyWrite = false;
+static bool writeVerified;
+static digest_ctx_t writeDigest;
+
+static void verify_program(uint32_t address, const uint8_t * data, uint32_t programSize) {
+  uint32_t offset = 0;
+
+  if (!verifyWrite) {
+    return;
+  }
+
+  while (offset < programSize) {
+    uint32_t size = programSize - offset < BL_DIGEST_BLOCK_MAX ? programSize - offset : BL_DIGEST_BLOCK_MAX;
+
+    flash_read(address + offset, digestBuffers[0], size);
+    if (memcmp(digestBuffers[0], &data[offset], size) != 0) {
+      DEBUG_PRINTF("Verification failed for chunk @ 0x%X\n", address + offset);
+      writeVerified = false;
+    }
+    digest_update(&writeDigest, digestBuffers[0], size);
+
+    offset += size;
+  }
+}
+
+// Program everything that has been written and wait for it
+static void wait_for_program(void) {
+  flash_combine_flush();
+}
+
+// Write a chunk, data can be reused when this returns
+static void program_chunk(uint32_t address, const uint8_t * data, uint32_t size) {
+  erase_wait(address + size);
+
+  DEBUG_PRINTF("Writing chunk of %u@0x%X...\n", size, address);
+  flash_combine_write(address, data, size);
+}
+
+static BLWriteJournal_t journal;
+
+// The journal CRC is calculated on the data as it's programmed, in order.
+// journalCrc covers [journal.start, journalCrcEnd) and the mark is the last
+// point that can be recorded, with the CRC up to there.
+static uint32_t journalCrc;
+static uint32_t journalCrcEnd;
+static uint32_t journalMarkEnd;
+static uint32_t journalMarkCrc;
+// In sparse writes the gaps between programs are erased runs
+static bool journalGapsErased;
+// A program has landed after a gap that isn't erased, the data in between is
+// read back once it has all been programmed
+static bool journalOutOfOrder;
+
+static const uint8_t erasedBlock[64] = { [0 ... 63] = BL_BYTE };
+
+// Add the next size bytes of the write to the CRC, data is NULL for erased runs
+static void journal_fold(const uint8_t * data, uint32_t size) {
+  uint32_t writeEnd = journal.start + journal.size;
+
+  while (size > 0) {
+    uint32_t next = (journalCrcEnd / BL_JOURNAL_INTERVAL + 1) * BL_JOURNAL_INTERVAL;
+    uint32_t foldSize = next - journalCrcEnd < size ? next - journalCrcEnd : size;
+
+    if (data != NULL) {
+      journalCrc = crc32_update(journalCrc, data, foldSize);
+      data += foldSize;
+    } else {
+      for (uint32_t done = 0; done < foldSize; done += sizeof(erasedBlock)) {
+        uint32_t blockSize = foldSize - done < sizeof(erasedBlock) ? foldSize - done : sizeof(erasedBlock);
+        journalCrc = crc32_update(journalCrc, erasedBlock, blockSize);
+      }
+    }
+    journalCrcEnd += foldSize;
+    size -= foldSize;
+
+    if (journalCrcEnd == next || journalCrcEnd == writeEnd) {
+      journalMarkEnd = journalCrcEnd;
+      journalMarkCrc = journalCrc;
+    }
+  }
+}
+
+// Called for each completed program of the write
+static void journal_programmed(uint32_t address, const uint8_t * data, uint32_t size) {
+  if (address > journalCrcEnd && journalGapsErased) {
+    journal_fold(NULL, address - journalCrcEnd);
+  }
+
+  if (address == journalCrcEnd) {
+    journal_fold(data, size);
+  } else if (address > journalCrcEnd) {
+    journalOutOfOrder = true;
+  }
+}
+
+// Start the journal of a write, or continue the previous one if the write is
+// the rest of it
+static void journal_start(uint32_t start, uint32_t size) {
+  journalGapsErased = false;
+  journalOutOfOrder = false;
+
+  if (!meta_read(META_TYPE_JOURNAL, &journal, sizeof(journal)) || journal.done >= journal.size ||
+      start != journal.start + journal.done || start + size != journal.start + journal.size) {
+    journal.start = start;
+    journal.size = size;
+    journal.done = 0;
+    journal.crc = 0;
+    meta_write(META_TYPE_JOURNAL, &journal, sizeof(journal));
+  } else {
+    DEBUG_PRINTF("Continuing write of %ub @ 0x%X from %ub\n", journal.size, journal.start, journal.done);
+  }
+
+  journalCrc = journal.crc;
+  journalCrcEnd = journal.start + journal.done;
+  journalMarkEnd = journalCrcEnd;
+  journalMarkCrc = journalCrc;
+}
+
+// Store the progress if a mark has been passed since last time
+static void journal_record(void) {
+  if (journalMarkEnd <= journal.start + journal.done) {
+    return;
+  }
+
+  // Erased runs are only done once the erase has passed them
+  if (journalGapsErased) {
+    erase_wait(journalMarkEnd);
+  }
+
+  journal.done = journalMarkEnd - journal.start;
+  journal.crc = journalMarkCrc;
+  DEBUG_PRINTF("Journal: %ub of %ub done\n", journal.done, journal.size);
+  meta_write(META_TYPE_JOURNAL, &journal, sizeof(journal));
+}
+
+// Everything below end has been handed to the flash
+static void journal_progress(uint32_t end) {
+  uint32_t writeEnd = journal.start + journal.size;
+
+  if (journalOutOfOrder && journalCrcEnd < end &&
+      (end == writeEnd || end / BL_JOURNAL_INTERVAL > journalCrcEnd / BL_JOURNAL_INTERVAL)) {
+    if (end < writeEnd) {
+      end = end / BL_JOURNAL_INTERVAL * BL_JOURNAL_INTERVAL;
+    }
+
+    wait_for_program();
+    while (journalCrcEnd < end) {
+      uint32_t size = end - journalCrcEnd < BL_DIGEST_BLOCK_MAX ? end - journalCrcEnd : BL_DIGEST_BLOCK_MAX;
+      flash_read(journalCrcEnd, digestBuffers[0], size);
+      journal_fold(digestBuffers[0], size);
+    }
+  }
+
+  journal_record();
+}
+
+// Everything below end has been handed to the flash and nothing more will be
+static void journal_finish(uint32_t end) {
+  wait_for_program();
+  if (journalGapsErased && journalCrcEnd < end) {
+    journal_fold(NULL, end - journalCrcEnd);
+  }
+  journal_progress(end);
+}
+
+// Combined programs are verified and added to the journal once done
+static void write_programmed(uint32_t address, const uint8_t * data, uint32_t size) {
+  journal_programmed(address, data, size);
+  verify_program(address, data, size);
+}
+
+// Anything erased in the journalled area makes the journal useless
+static void journal_invalidate(uint32_t start, uint32_t size) {
+  if (meta_read(META_TYPE_JOURNAL, &journal, sizeof(journal)) && journal.done > 0 &&
+      start < journal.start + journal.done && start + size > journal.start) {
+    journal.done = 0;
+    journal.crc = 0;
+    meta_write(META_TYPE_JOURNAL, &journal, sizeof(journal));
+  }
+}
+
+// The host has gone away, what was completed is in the journal
+static void abandon_write(void) {
+  DEBUG_PRINTF("No data for %u ms, abandoning write\n", BL_WRITE_TIMEOUT_MS);
+  wait_for_program();
+  journal_record();
+  erase_abort();
+  verifyWrite = false;
+}
+
+// The bootloader and its metadata are never erased or written
+static bool in_app_area(uint32_t start, uint32_t size) {
+  return start >= FIRMWARE_START_ADDRESS && start <= META_ADDRESS && size <= META_ADDRESS - start;
+}
+
+// The rest of the first and last sectors must also fit in the keep buffer,
+// since the write erases them in the background
+static bool can_write(uint32_t start, uint32_t size) {
+  if (!in_app_area(start, size)) {
+    DEBUG_PRINTF("Not writing %ub @ 0x%X outside of the application area\n", size, start);
+    return false;
+  }
+  if (!erase_can_keep(start, size)) {
+    DEBUG_PRINTF("Not writing %ub @ 0x%X, the rest of its sectors can't be kept\n", size, start);
+    return false;
+  }
+  return true;
+}
+
+uint16_t bl_handleEraseCommand(ReadIn_t * info, EraseOut_t * out) {
+  uint32_t sectors = 0;
+  uint32_t skipped = 0;
+  uint32_t kept = 0;
+
+  if (!in_app_area(info->start, info->size)) {
+    DEBUG_PRINTF("Not erasing %ub @ 0x%X outside of the application area\n", info->size, info->start);
+    out->ok = false;
+  } else {
+    DEBUG_PRINTF("Erasing %ub @ 0x%X\n", info->size, info->start);
+    invalidate_image(info->start, info->size);
+    journal_invalidate(info->start, info->size);
+    out->ok = erase_range(info->start, info->size, &sectors, &skipped, &kept);
+  }
+  out->sectors = sectors;
+  out->kept = kept;
+  out->skipped = skipped;
+
+  return sizeof(EraseOut_t);
+}
+
+uint16_t bl_handleJournalCommand(BLWriteJournal_t * out) {
+  if (!meta_read(META_TYPE_JOURNAL, out, sizeof(BLWriteJournal_t))) {
+    memset(out, 0, sizeof(BLWriteJournal_t));
+  }
+
+  return sizeof(BLWriteJournal_t);
+}
+
+void bl_handleWriteCommand(ReadIn_t * info) {
 
   // Sanity check data and return something
 
   uint32_t sizeLeft;
   uint32_t currentBaseAddress;
-  uint32_t chunkSize;
 
   sizeLeft = info->size;
   currentBaseAddress = info->start;
-  chunkSize = 0;
+
+  // The data is still received so it isn't taken as commands
+  if (!can_write(currentBaseAddress, sizeLeft)) {
+    while (sizeLeft > 0) {
+      CPXPacket_t * packet;
+      uint32_t size = cpxReceivePacketTimeout(&packet, BL_WRITE_TIMEOUT_MS);
+      if (packet == NULL) {
+        return;
+      }
+      if (packet->route.function == BOOTLOADER) {
+        sizeLeft -= size < sizeLeft ? size : sizeLeft;
+      }
+      cpxFreePacket(packet);
+    }
+    return;
+  }
 
   DEBUG_PRINTF("Start update of size %ub @ 0x%X\n", sizeLeft, currentBaseAddress);
+  invalidate_image(currentBaseAddress, sizeLeft);
+  journal_start(currentBaseAddress, sizeLeft);
+  erase_start(currentBaseAddress, sizeLeft);
+  flash_combine_start(write_programmed);
   do {
     // Read the next data packet
-    uint32_t size = cpxReceivePacketBlocking(rxp);
-    if (rxp->route.function == BOOTLOADER) {
-
-      uint32_t bytesToPageBoundary = PAGE_SIZE - currentBaseAddress % PAGE_SIZE;
-
-      if (currentBaseAddress % PAGE_SIZE == 0) {
-        DEBUG_PRINTF("Erasing flash page @ 0x%X...\n", currentBaseAddress);
-        flash_erase_sector(currentBaseAddress);
-        DEBUG_PRINTF("done!\n");
-      } else if (bytesToPageBoundary < size) {
-        uint32_t nextPageAddress = currentBaseAddress + bytesToPageBoundary;
-        DEBUG_PRINTF("Erasing flash page @ 0x%X...\n", nextPageAddress);
-        flash_erase_sector(nextPageAddress);
-        DEBUG_PRINTF("done!\n");
+    CPXPacket_t * packet;
+    uint32_t size = cpxReceivePacketTimeout(&packet, BL_WRITE_TIMEOUT_MS);
+    if (packet == NULL) {
+      abandon_write();
+      return;
+    }
+    if (packet->route.function == BOOTLOADER) {
+      // Anything past the announced size isn't written
+      if (size > sizeLeft) {
+        size = sizeLeft;
       }
-
-      DEBUG_PRINTF("Writing chunk of %u@0x%X...\n", size, currentBaseAddress);
-      flash_write(currentBaseAddress, rxp->data, size);
-      DEBUG_PRINTF("done!\n");
+      program_chunk(currentBaseAddress, packet->data, size);
+      cpxFreePacket(packet);
 
       currentBaseAddress += size;
       sizeLeft -= size;
+      journal_progress(currentBaseAddress);
       DEBUG_PRINTF("Size left = %u, currentBase=0x%X\n", sizeLeft, currentBaseAddress);
     } else {
       DEBUG_PRINTF("We got a packet not for the bootloader while writing\n");
+      cpxFreePacket(packet);
     }
   } while (sizeLeft > 0);
+  journal_finish(currentBaseAddress);
   DEBUG_PRINTF("Write completed\n");
 }
 
-#define MAX_NB_SEGMENT 16
-#define L2_BUFFER_SIZE 512
+// Compressed chunks are decoded into this window, one half is written while the
+// other half is being filled. It's shared to save L2: the erase keeps the rest
+// of partly erased sectors in it until erase_keep_wait returns, sparse writes
+// program zero runs from it and when booting it's bounce buffers for loading
+// segments.
+static PI_L2 uint8_t lzWindow[BL_LZ_WINDOW_SIZE];
+static lz_decoder_t lz;
+static uint32_t lzAddress;
+
+void bl_init(void) {
+  erase_init(lzWindow, sizeof(lzWindow));
+}
+
+static void program_lz_output(uint8_t * data, uint32_t size) {
+  program_chunk(lzAddress, data, size);
+  lzAddress += size;
+}
+
+// Runs of a sparse write that are left erased are neither sent nor programmed,
+// zero runs are programmed from the LZ window which isn't used by the write
+static uint32_t sparseAddress;
+static uint32_t sparseEnd;
+
+// Erased runs are read back when verifying, as the erase could have failed
+static void verify_erased(uint32_t address, uint32_t size) {
+  // Keep the digest in order
+  wait_for_program();
+  erase_wait(address + size);
+
+  while (size > 0) {
+    uint32_t blockSize = size < BL_DIGEST_BLOCK_MAX ? size : BL_DIGEST_BLOCK_MAX;
+
+    flash_read(address, digestBuffers[0], blockSize);
+    for (uint32_t i = 0; i < blockSize; i++) {
+      if (digestBuffers[0][i] != BL_BYTE) {
+        DEBUG_PRINTF("Verification failed for erased run @ 0x%X\n", address);
+        writeVerified = false;
+        break;
+      }
+    }
+    digest_update(&writeDigest, digestBuffers[0], blockSize);
+
+    address += blockSize;
+    size -= blockSize;
+  }
+}
+
+static void program_sparse_run(BLSparseRun_t type, const uint8_t * data, uint32_t size) {
+  switch (type) {
+    case BL_SPARSE_DATA:
+      if (size > 0) {
+        program_chunk(sparseAddress, data, size);
+      }
+      break;
+    case BL_SPARSE_ERASED:
+      if (verifyWrite) {
+        verify_erased(sparseAddress, size);
+      }
+      break;
+    case BL_SPARSE_ZERO:
+      for (uint32_t done = 0; done < size; done += sizeof(lzWindow)) {
+        uint32_t zeroSize = size - done < sizeof(lzWindow) ? size - done : sizeof(lzWindow);
+        program_chunk(sparseAddress + done, lzWindow, zeroSize);
+      }
+      break;
+  }
+
+  sparseAddress += size;
+}
+
+// Program the runs of one chunk, returns false if they are malformed or don't
+// fit in the write
+static bool program_sparse(uint8_t * data, uint32_t size) {
+  return sparse_parse(data, size, sparseEnd - sparseAddress, program_sparse_run) >= 0;
+}
+
+static void send_write_ack(const CPXRouting_t * route, uint16_t seq, BLWriteStatus_t status, uint8_t window) {
+  CPXPacket_t * txp = bl_allocReply(route);
+  BLPacket_t * blpTx = (BLPacket_t*) txp->data;
+  WriteAckOut_t * ack = (WriteAckOut_t*) blpTx->data;
+
+  trace_log(TRACE_WRITE_ACK, status, seq);
+  blpTx->cmd = BL_CMD_WRITE_WINDOWED;
+  ack->seq = seq;
+  ack->status = status;
+  ack->window = window;
+
+  cpxSendPacketBlocking(txp, sizeof(BLCommand_t) + sizeof(WriteAckOut_t));
+}
+
+// The final ACK tells the host how many sectors didn't have to be erased
+static void fill_write_done(WriteDoneOut_t * done, uint16_t seq, uint8_t window) {
+  uint32_t erased;
+  uint32_t skipped;
+
+  erase_counts(&erased, &skipped);
+  trace_log(TRACE_WRITE_ACK, BL_WRITE_STATUS_DONE, seq);
+  done->ack.seq = seq;
+  done->ack.status = BL_WRITE_STATUS_DONE;
+  done->ack.window = window;
+  done->erased = erased;
+  done->eraseSkipped = skipped;
+}
+
+static void send_write_done(const CPXRouting_t * route, uint16_t seq, uint8_t window) {
+  CPXPacket_t * txp = bl_allocReply(route);
+  BLPacket_t * blpTx = (BLPacket_t*) txp->data;
+
+  blpTx->cmd = BL_CMD_WRITE_WINDOWED;
+  fill_write_done((WriteDoneOut_t*) blpTx->data, seq, window);
+
+  cpxSendPacketBlocking(txp, sizeof(BLCommand_t) + sizeof(WriteDoneOut_t));
+}
+
+static void send_write_verify(const WriteWindowedIn_t * info, const CPXRouting_t * route, uint16_t seq, uint8_t window) {
+  CPXPacket_t * txp = bl_allocReply(route);
+  BLPacket_t * blpTx = (BLPacket_t*) txp->data;
+  WriteVerifyOut_t * out = (WriteVerifyOut_t*) blpTx->data;
+
+  blpTx->cmd = BL_CMD_WRITE_WINDOWED;
+  fill_write_done(&out->done, seq, window);
+  out->algorithm = writeDigest.algorithm;
+  uint32_t digestSize = digest_final(&writeDigest, out->digest);
+  out->verified = writeVerified && digestSize > 0;
+
+  if (out->verified) {
+    verifiedStart = info->start;
+    verifiedSize = info->size;
+    verifiedAlgorithm = out->algorithm;
+    verifiedDigestSize = digestSize;
+    memcpy(verifiedDigest, out->digest, digestSize);
+  }
+
+  cpxSendPacketBlocking(txp, sizeof(BLCommand_t) + offsetof(WriteVerifyOut_t, digest) + digestSize);
+}
+
+// Chunks received in a write with BL_WRITE_FLAG_CRC
+static uint8_t chunkBitmap[BL_WRITE_CRC_CHUNKS_MAX / 8];
+
+static bool chunk_received(uint32_t seq) {
+  return (chunkBitmap[seq / 8] & (1 << (seq % 8))) != 0;
+}
+
+static void send_write_gaps(const CPXRouting_t * route, uint32_t firstMissing, uint32_t chunks, uint8_t window) {
+  CPXPacket_t * txp = bl_allocReply(route);
+  BLPacket_t * blpTx = (BLPacket_t*) txp->data;
+  WriteGapsOut_t * out = (WriteGapsOut_t*) blpTx->data;
+  uint32_t maxBits = (sizeof(blpTx->data) - sizeof(WriteGapsOut_t)) * 8;
+  uint32_t bits = chunks - firstMissing < maxBits ? chunks - firstMissing : maxBits;
+
+  trace_log(TRACE_WRITE_ACK, BL_WRITE_STATUS_GAPS, firstMissing);
+  blpTx->cmd = BL_CMD_WRITE_WINDOWED;
+  out->ack.seq = firstMissing;
+  out->ack.status = BL_WRITE_STATUS_GAPS;
+  out->ack.window = window;
+
+  memset(out->missing, 0, (bits + 7) / 8);
+  for (uint32_t i = 0; i < bits; i++) {
+    if (!chunk_received(firstMissing + i)) {
+      out->missing[i / 8] |= 1 << (i % 8);
+    }
+  }
+
+  cpxSendPacketBlocking(txp, sizeof(BLCommand_t) + sizeof(WriteGapsOut_t) + (bits + 7) / 8);
+}
+
+// Every chunk has its own CRC and position, so damaged chunks can be resent
+// one by one and the rest are programmed as they arrive. The ACKs are
+// cumulative up to the first missing chunk. The chunk size and flags have
+// been checked by windowed_write_supported.
+static void write_selective(WriteWindowedIn_t * info, const CPXRouting_t * route, uint8_t window, uint8_t ackInterval) {
+  uint32_t chunkSize = info->chunkSize;
+  uint32_t chunks = (info->size + chunkSize - 1) / chunkSize;
+  uint32_t received = 0;
+  uint32_t firstMissing = 0;
+  uint8_t chunksSinceAck = 0;
+
+  memset(chunkBitmap, 0, (chunks + 7) / 8);
+  erase_start(info->start, info->size);
+  flash_combine_start(write_programmed);
+  send_write_ack(route, 0, chunks > 0 ? BL_WRITE_STATUS_OK : BL_WRITE_STATUS_DONE, window);
+
+  while (received < chunks) {
+    CPXPacket_t * packet;
+    uint32_t size = cpxReceivePacketTimeout(&packet, BL_WRITE_TIMEOUT_MS);
+
+    if (packet == NULL) {
+      abandon_write();
+      return;
+    }
+
+    WriteCrcChunk_t * chunk = (WriteCrcChunk_t*) packet->data;
+    if (packet->route.function != BOOTLOADER || size < sizeof(WriteCrcChunk_t) || chunk->cmd != BL_CMD_WRITE_DATA) {
+      DEBUG_PRINTF("Dropping packet that isn't a chunk\n");
+      cpxFreePacket(packet);
+      continue;
+    }
+    size -= sizeof(WriteCrcChunk_t);
+
+    if (chunk->seq == BL_WRITE_SEQ_REPORT && size == 0) {
+      cpxFreePacket(packet);
+      send_write_gaps(route, firstMissing, chunks, window);
+      continue;
+    }
+
+    uint32_t crc = crc32_update(0, (uint8_t *) &chunk->seq, sizeof(WriteCrcChunk_t) - offsetof(WriteCrcChunk_t, seq) + size);
+    uint32_t expectedSize = chunk->seq + 1 < chunks ? chunkSize : info->size - (chunks - 1) * chunkSize;
+
+    if (crc != chunk->crc || chunk->seq >= chunks || chunk->offset != chunk->seq * chunkSize || size != expectedSize) {
+      // The seq of a damaged chunk can't be trusted, the host finds out which
+      // chunk it was from a gaps report
+      DEBUG_PRINTF("Chunk %u is damaged\n", chunk->seq);
+      cpxFreePacket(packet);
+      send_write_ack(route, firstMissing, BL_WRITE_STATUS_BAD_CRC, window);
+      continue;
+    }
+
+    if (chunk_received(chunk->seq)) {
+      cpxFreePacket(packet);
+      continue;
+    }
+
+    DEBUG_PRINTF("Chunk %u\n", chunk->seq);
+    trace_log(TRACE_WRITE_CHUNK, 0, chunk->seq);
+    chunkBitmap[chunk->seq / 8] |= 1 << (chunk->seq % 8);
+    received++;
+    while (firstMissing < chunks && chunk_received(firstMissing)) {
+      firstMissing++;
+    }
+
+    program_chunk(info->start + chunk->offset, chunk->data, size);
+    cpxFreePacket(packet);
+    journal_progress(firstMissing < chunks ? info->start + firstMissing * chunkSize : info->start + info->size);
+
+    if (received < chunks && ++chunksSinceAck >= ackInterval) {
+      send_write_ack(route, firstMissing, BL_WRITE_STATUS_OK, window);
+      chunksSinceAck = 0;
+    }
+  }
+
+  journal_finish(info->start + info->size);
+  send_write_done(route, chunks, window);
+  DEBUG_PRINTF("Selective write completed\n");
+}
+
+// Everything that makes a windowed write refused is checked up front, before
+// anything in the metadata is changed
+static bool windowed_write_supported(WriteWindowedIn_t * info) {
+  bool compressed = (info->flags & BL_WRITE_FLAG_LZ) != 0;
+  bool sparse = (info->flags & BL_WRITE_FLAG_SPARSE) != 0;
+
+  if ((info->flags & BL_WRITE_FLAG_CRC) != 0) {
+    uint32_t chunkSize = info->chunkSize;
+
+    if (chunkSize == 0 || chunkSize > sizeof(((CPXPacket_t *) 0)->data) - sizeof(WriteCrcChunk_t) ||
+        (info->flags & (BL_WRITE_FLAG_LZ | BL_WRITE_FLAG_VERIFY | BL_WRITE_FLAG_SPARSE)) != 0) {
+      return false;
+    }
+
+    return (info->size + chunkSize - 1) / chunkSize <= BL_WRITE_CRC_CHUNKS_MAX;
+  }
+
+  if (compressed && sparse) {
+    return false;
+  }
+
+  // Only initialised to check the algorithm, it's done again when writing
+  if ((info->flags & BL_WRITE_FLAG_VERIFY) != 0 && !digest_init(&writeDigest, info->algorithm)) {
+    return false;
+  }
+
+  return true;
+}
+
+void bl_handleWriteWindowedCommand(WriteWindowedIn_t * info, const CPXRouting_t * route) {
+  uint32_t sizeLeft;
+  uint32_t currentBaseAddress;
+  uint16_t expectedSeq;
+  uint8_t window;
+  uint8_t ackInterval;
+  uint8_t chunksSinceAck;
+  bool nackSent;
+  bool overflow;
+  bool compressed;
+  bool sparse;
+
+  sizeLeft = info->size;
+  currentBaseAddress = info->start;
+  expectedSeq = 0;
+  chunksSinceAck = 0;
+  nackSent = false;
+  overflow = false;
+  compressed = (info->flags & BL_WRITE_FLAG_LZ) != 0;
+  sparse = (info->flags & BL_WRITE_FLAG_SPARSE) != 0;
+
+  window = info->window;
+  if (window == 0 || window > BL_WRITE_WINDOW_MAX) {
+    window = BL_WRITE_WINDOW_MAX;
+  }
+
+  // Acknowledge every half window so the host can keep sending while we
+  // are busy programming (or erasing) the rest of it
+  ackInterval = window / 2 > 0 ? window / 2 : 1;
+
+  if (!windowed_write_supported(info) || !can_write(currentBaseAddress, sizeLeft)) {
+    DEBUG_PRINTF("Refusing windowed write with flags 0x%02X\n", info->flags);
+    send_write_ack(route, expectedSeq, BL_WRITE_STATUS_UNSUPPORTED, window);
+    return;
+  }
+
+  DEBUG_PRINTF("Start windowed update of size %ub @ 0x%X (window %u)\n", sizeLeft, currentBaseAddress, window);
+  invalidate_image(currentBaseAddress, sizeLeft);
+  journal_start(currentBaseAddress, sizeLeft);
+
+  if (info->flags & BL_WRITE_FLAG_CRC) {
+    write_selective(info, route, window, ackInterval);
+    return;
+  }
+
+  verifyWrite = (info->flags & BL_WRITE_FLAG_VERIFY) != 0;
+  if (verifyWrite) {
+    writeVerified = digest_init(&writeDigest, info->algorithm);
+  }
+
+  erase_start(currentBaseAddress, sizeLeft);
+  flash_combine_start(write_programmed);
+
+  if (compressed) {
+    lzAddress = currentBaseAddress;
+    lz_init(&lz, lzWindow, sizeof(lzWindow), sizeLeft, program_lz_output);
+  }
+
+  if (sparse) {
+    sparseAddress = currentBaseAddress;
+    sparseEnd = currentBaseAddress + sizeLeft;
+    journalGapsErased = true;
+  }
+
+  // The first ACK tells the host the window it's allowed to use
+  send_write_ack(route, expectedSeq, sizeLeft > 0 ? BL_WRITE_STATUS_OK : BL_WRITE_STATUS_DONE, window);
+
+  // Only touch the shared window once the erase doesn't need it anymore, that
+  // can take two sector erases so it's done after the first ACK to not time
+  // out the host
+  if (compressed || sparse) {
+    erase_keep_wait();
+  }
+
+  if (sparse) {
+    memset(lzWindow, 0, sizeof(lzWindow));
+  }
+
+  while (sizeLeft > 0) {
+    CPXPacket_t * packet;
+    uint32_t size = cpxReceivePacketTimeout(&packet, BL_WRITE_TIMEOUT_MS);
+
+    if (packet == NULL) {
+      abandon_write();
+      return;
+    }
+
+    if (packet->route.function != BOOTLOADER) {
+      DEBUG_PRINTF("We got a packet not for the bootloader while writing\n");
+      cpxFreePacket(packet);
+      continue;
+    }
+
+    WriteChunk_t * chunk = (WriteChunk_t*) packet->data;
+    if (size < offsetof(WriteChunk_t, data) || chunk->cmd != BL_CMD_WRITE_DATA) {
+      DEBUG_PRINTF("Dropping packet that isn't a chunk\n");
+      cpxFreePacket(packet);
+      continue;
+    }
+    size -= offsetof(WriteChunk_t, data);
+
+    if (chunk->seq == BL_WRITE_SEQ_REPORT && size == 0) {
+      cpxFreePacket(packet);
+      send_write_ack(route, expectedSeq, BL_WRITE_STATUS_OUT_OF_ORDER, window);
+      nackSent = true;
+      continue;
+    }
+
+    if (chunk->seq != expectedSeq) {
+      // Only NACK once, the rest of the window is already in flight and
+      // will be dropped here until the host has rewound
+      DEBUG_PRINTF("Expected chunk %u but got %u\n", expectedSeq, chunk->seq);
+      cpxFreePacket(packet);
+      if (!nackSent) {
+        send_write_ack(route, expectedSeq, BL_WRITE_STATUS_OUT_OF_ORDER, window);
+        nackSent = true;
+      }
+      continue;
+    }
+    nackSent = false;
+
+    DEBUG_PRINTF("Chunk %u\n", expectedSeq);
+    trace_log(TRACE_WRITE_CHUNK, 0, expectedSeq);
+    if (compressed || sparse) {
+      bool corrupt;
+      if (compressed) {
+        // The decoder programs the output itself and the packet can be freed
+        corrupt = lz_decode(&lz, chunk->data, size) < 0;
+        cpxFreePacket(packet);
+        currentBaseAddress = lzAddress;
+        sizeLeft = lz.outputLeft;
+      } else {
+        corrupt = !program_sparse(chunk->data, size);
+        cpxFreePacket(packet);
+        currentBaseAddress = sparseAddress;
+        sizeLeft = sparseEnd - sparseAddress;
+      }
+      if (corrupt) {
+        DEBUG_PRINTF("Chunk data is corrupt, aborting write\n");
+        wait_for_program();
+        erase_abort();
+        verifyWrite = false;
+        send_write_ack(route, expectedSeq, BL_WRITE_STATUS_CORRUPT, window);
+        return;
+      }
+    } else {
+      // Reported in the final ACK, as ACKs are never sent back to back
+      // without reading in between
+      if (size > sizeLeft) {
+        DEBUG_PRINTF("Chunk overflows the write area, truncating it\n");
+        size = sizeLeft;
+        overflow = true;
+      }
+
+      program_chunk(currentBaseAddress, chunk->data, size);
+      cpxFreePacket(packet);
+
+      currentBaseAddress += size;
+      sizeLeft -= size;
+    }
+    journal_progress(currentBaseAddress);
+    expectedSeq++;
+    chunksSinceAck++;
+
+    if (sizeLeft == 0) {
+      // Sectors with only erased runs may still be being erased
+      journal_finish(currentBaseAddress);
+      erase_wait(currentBaseAddress);
+      if (overflow) {
+        send_write_ack(route, expectedSeq, BL_WRITE_STATUS_OVERFLOW, window);
+      } else if (verifyWrite) {
+        send_write_verify(info, route, expectedSeq, window);
+      } else {
+        send_write_done(route, expectedSeq, window);
+      }
+    } else if (chunksSinceAck >= ackInterval) {
+      send_write_ack(route, expectedSeq, BL_WRITE_STATUS_OK, window);
+      chunksSinceAck = 0;
+    }
+  }
+  verifyWrite = false;
+  DEBUG_PRINTF("Windowed write completed\n");
+}
 
-static PI_L2 uint8_t l2_buffer[L2_BUFFER_SIZE]; 
+// Segments not in L2 are loaded through two bounce buffers, one is filled by
+// the uDMA while the other is copied to its destination
+#define BOOT_BOUNCE_SIZE (BL_LZ_WINDOW_SIZE / 2)
+
+// One flash read of the segment loading, either straight to the destination
+// or to a bounce buffer that is copied once the read is done
 typedef struct {
-  uint32_t offset;
-  uint32_t base;
+  uint32_t flashAddress;
+  uint8_t * ram;
   uint32_t size;
-  uint32_t nBlocks;
-} bin_segment_t;
+  uint8_t * bounce;
+} load_step_t;
 
 typedef struct {
-  uint32_t size;
+  const bin_segment_t * segments;
   uint32_t nSegments;
-  uint32_t entry;
-  uint32_t entryBase;
-  bin_segment_t segments[MAX_NB_SEGMENT];
-} bin_header_t;
+  uint32_t index;
+  uint32_t loaded;
+  uint32_t nextBounce;
+} segment_loader_t;
 
-static void load_segment(const uint32_t application_offset, const bin_segment_t *segment)
-{ 
+static bool is_l2_address(uint32_t address) {
+  return address >= 0x1C000000 && address < 0x1D000000;
+}
 
-    bool isL2Section = segment->base >= 0x1C000000 && segment->base < 0x1D000000;
-    
-    if(isL2Section) {
-        DEBUG_PRINTF("Load segment to L2 memory at 0x%lX\n", segment->base);
-        flash_read(application_offset + segment->offset, (void*) segment->base, segment->size);
-    } else {
-        DEBUG_PRINTF("Load segment to FC TCDM memory at 0x%lX (using a L2 buffer)\n", segment->base);
-        size_t remaining_size = segment->size;
-        uint32_t flashBase = application_offset + segment->offset;
-        uint8_t * ramBase = (uint8_t *) segment->base;
-        while (remaining_size > 0) {
-            size_t iter_size = (remaining_size > L2_BUFFER_SIZE) ? L2_BUFFER_SIZE : remaining_size;
-            DEBUG_PRINTF("Remaining size 0x%lX, it size %lu, 0x%X -> 0x%0X\n", remaining_size, iter_size, flashBase, ramBase);
-            flash_read(flashBase, l2_buffer, iter_size);
-            memcpy(ramBase, (void *) l2_buffer, iter_size);
-            remaining_size -= iter_size;
-            flashBase += iter_size;
-            ramBase += iter_size;
-        }
+// Merge segments that are contiguous both in flash and in memory, so they are
+// loaded with as few transfers as possible. Returns the new number of segments.
+static uint32_t merge_segments(bin_segment_t * segments, uint32_t nSegments) {
+  uint32_t n = 0;
+
+  for (uint32_t i = 0; i < nSegments; i++) {
+    if (segments[i].size == 0) {
+      continue;
     }
+
+    if (n > 0) {
+      bin_segment_t * last = &segments[n - 1];
+      if (last->offset + last->size == segments[i].offset &&
+          last->base + last->size == segments[i].base &&
+          is_l2_address(last->base) == is_l2_address(segments[i].base)) {
+        DEBUG_PRINTF("Merging segment at 0x%X into segment at 0x%X\n", segments[i].base, last->base);
+        last->size += segments[i].size;
+        continue;
+      }
+    }
+
+    segments[n++] = segments[i];
+  }
+
+  return n;
+}
+
+static bool next_load_step(segment_loader_t * loader, load_step_t * step) {
+  if (loader->index >= loader->nSegments) {
+    return false;
+  }
+
+  const bin_segment_t * segment = &loader->segments[loader->index];
+  uint32_t remaining = segment->size - loader->loaded;
+
+  step->flashAddress = FIRMWARE_START_ADDRESS + segment->offset + loader->loaded;
+  step->ram = (uint8_t *) (segment->base + loader->loaded);
+
+  if (is_l2_address(segment->base)) {
+    // The uDMA can read straight to L2
+    step->size = remaining;
+    step->bounce = NULL;
+  } else {
+    step->size = remaining > BOOT_BOUNCE_SIZE ? BOOT_BOUNCE_SIZE : remaining;
+    step->bounce = &lzWindow[loader->nextBounce * BOOT_BOUNCE_SIZE];
+    loader->nextBounce ^= 1;
+  }
+
+  loader->loaded += step->size;
+  if (loader->loaded >= segment->size) {
+    loader->index++;
+    loader->loaded = 0;
+  }
+
+  return true;
+}
+
+static void start_load_step(const load_step_t * step, flash_request_t * request) {
+  DEBUG_PRINTF("Load 0x%X bytes from 0x%X to 0x%X%s\n", step->size, step->flashAddress, step->ram,
+               step->bounce ? " (using a L2 buffer)" : "");
+  flash_read_submit(request, step->flashAddress, step->bounce ? step->bounce : step->ram, step->size);
+}
+
+// Load the segments, the next flash read is started before the previous one is
+// copied out of its bounce buffer
+static void load_segments(const bin_segment_t * segments, uint32_t nSegments) {
+  static flash_request_t loadRequest;
+  segment_loader_t loader = {.segments = segments, .nSegments = nSegments};
+  load_step_t steps[2];
+  int current = 0;
+
+  if (!next_load_step(&loader, &steps[current])) {
+    return;
+  }
+  start_load_step(&steps[current], &loadRequest);
+
+  while (true) {
+    flash_request_wait(&loadRequest);
+
+    bool more = next_load_step(&loader, &steps[current ^ 1]);
+    if (more) {
+      start_load_step(&steps[current ^ 1], &loadRequest);
+    }
+
+    if (steps[current].bounce) {
+      memcpy(steps[current].ram, steps[current].bounce, steps[current].size);
+    }
+
+    if (!more) {
+      break;
+    }
+    current ^= 1;
+  }
 }
 
 static inline void __attribute__((noreturn)) jump_to_address(unsigned int address)
@@ -205,11 +1370,13 @@ static inline void __attribute__((noreturn)) jump_to_address(unsigned int addres
 }
 
 #define VECTOR_TABLE_SIZE 0x94
-static bin_header_t header;
 
 void bl_boot_to_application(void) {
   DEBUG_PRINTF("Booting to application in flash @ 0x%X\n", FIRMWARE_START_ADDRESS);
 
+  // Nothing may be erased while loading, and the erase shares lzWindow
+  erase_abort();
+
   flash_read(FIRMWARE_START_ADDRESS, (uint8_t *) &header, sizeof(bin_header_t));
 
   // Binary size is header + segments until the partition table starts
@@ -235,7 +1402,14 @@ void bl_boot_to_application(void) {
   DEBUG_PRINTF("Entrypoint: 0x%X\n", header.entry);
   DEBUG_PRINTF("Entrypoint base?: 0x%X\n", header.entryBase);
 
-  if (header.nSegments == 0 || header.nSegments > MAX_NB_SEGMENT) {
+  BLImageDescriptor_t image;
+  if (read_image_descriptor(&image)) {
+    // A half written image has a header that doesn't match the verified one
+    if (!header_ok(&header, image.size) || header_crc(&header) != image.headerCrc) {
+      cpxPrintToConsole(LOG_TO_CRTP, "Binary application header doesn't match the verified image, not exiting bootloader\n");
+      return;
+    }
+  } else if (!header_ok(&header, 0)) {
     cpxPrintToConsole(LOG_TO_CRTP, "Binary application header doesn't seem ok, not exiting bootloader\n");
     return;
   }
@@ -250,14 +1424,10 @@ void bl_boot_to_application(void) {
       segment->nBlocks);
   }
 
-  // Start loading
+  // Skip interrupt table entries
   for (unsigned int i=0; i < header.nSegments; i++) {
     bin_segment_t * segment = &header.segments[i];
 
-    DEBUG_PRINTF("Load segment %u: flash offset 0x%lX - size 0x%lX\n",
-          i, segment->offset, segment->size);
-
-    // Skip interrupt table entries
     if(segment->base == 0x1C000000) {
       differ_copy_of_irq_table = true;
       flash_read(FIRMWARE_START_ADDRESS + segment->offset, (uint8_t*) buff, VECTOR_TABLE_SIZE);
@@ -265,10 +1435,13 @@ void bl_boot_to_application(void) {
       segment->offset += VECTOR_TABLE_SIZE;
       segment->size -= VECTOR_TABLE_SIZE;
     }
-
-      load_segment(FIRMWARE_START_ADDRESS, segment);
   }
 
+  // Start loading
+  uint32_t nSegments = merge_segments(header.segments, header.nSegments);
+  DEBUG_PRINTF("Loading %u segments\n", nSegments);
+  load_segments(header.segments, nSegments);
+
   //pi_flash_close(flash);
     
   DEBUG_PRINTF("Disable global IRQ and timer interrupt\n");
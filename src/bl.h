@@ -27,24 +27,103 @@
 
 #include "com.h"
 #include "cpx.h"
+#include "digest.h"
+#include "sparse.h"
+#include "stats.h"
+#include "trace.h"
 
 #ifndef __BL_H__
 #define __BL_H__
 
+// Protocol version reported by BL_CMD_VERSION and BL_CMD_INFO
+#define BL_VERSION (2)
+
 #define BL_PAYLOAD (MTU - 2)
 
+// Value of erased flash
 #define BL_BYTE          (0xFF)
 
+// Maximum number of un-acknowledged data chunks in a windowed write
+#define BL_WRITE_WINDOW_MAX (8)
+
+// Size of the history window for compressed writes, offsets are at most half of it
+#define BL_LZ_WINDOW_SIZE (4096)
+
+// Size of the flash reads when calculating digests, two are used to overlap
+// the reading of one with the hashing of the other
+#define BL_DIGEST_BLOCK_DEFAULT (512)
+#define BL_DIGEST_BLOCK_MAX (1024)
+
+// Flags for windowed writes
+#define BL_WRITE_FLAG_LZ (1 << 0) // The chunks are an LZ stream of size bytes of data
+#define BL_WRITE_FLAG_VERIFY (1 << 1) // Read back what is programmed and report its digest when done
+#define BL_WRITE_FLAG_CRC (1 << 2) // The chunks are WriteCrcChunk_t and can arrive in any order
+#define BL_WRITE_FLAG_SPARSE (1 << 3) // The chunks are lists of SparseRun_t describing size bytes of data
+
+// Max number of chunks in a write with BL_WRITE_FLAG_CRC, one bit is kept per chunk
+#define BL_WRITE_CRC_CHUNKS_MAX (16384)
+
+// Sequence number of an empty WriteCrcChunk_t asking for a BL_WRITE_STATUS_GAPS
+// report, its crc isn't checked. In other windowed writes an empty WriteChunk_t
+// with it is answered with a BL_WRITE_STATUS_OUT_OF_ORDER of the next expected
+// chunk, for hosts that got no ACK for a while.
+#define BL_WRITE_SEQ_REPORT (0xFFFF)
+
+// A write is abandoned when no chunk has arrived for this long, so a host that
+// lost the connection can come back and resume it from the journal
+#define BL_WRITE_TIMEOUT_MS (10000)
+
+// Features reported by BL_CMD_INFO
+#define BL_FEATURE_WRITE_WINDOWED (1 << 0)
+#define BL_FEATURE_HASHMAP (1 << 1)
+#define BL_FEATURE_LZ (1 << 2)
+#define BL_FEATURE_DIGEST (1 << 3)
+#define BL_FEATURE_WRITE_VERIFY (1 << 4)
+#define BL_FEATURE_BOOT_CONFIG (1 << 5)
+#define BL_FEATURE_IMAGE (1 << 6)
+#define BL_FEATURE_STATS (1 << 7)
+#define BL_FEATURE_TRACE (1 << 8)
+#define BL_FEATURE_BATCH (1 << 9)
+#define BL_FEATURE_WRITE_CRC (1 << 10)
+#define BL_FEATURE_JOURNAL (1 << 11)
+#define BL_FEATURE_SPARSE (1 << 12)
+#define BL_FEATURE_ERASE (1 << 13)
+#define BL_FEATURE_BLANK_CHECK (1 << 14)
+#define BL_FEATURE_WRITE_DATA (1 << 15)
+
 typedef enum {
   BL_CMD_VERSION = 0,
-  BL_CMD_ERASEPAGE = 1,
+  BL_CMD_ERASEPAGE = 1, // Erase a range, keeping the rest of partly covered sectors
   BL_CMD_WRITE = 2,
   BL_CMD_READ = 3,
   BL_CMD_MD5 = 4,
-  BL_CMD_INFO = 5, // Include sector and MTU size here!
-  BL_CMD_JMP = 6
+  BL_CMD_INFO = 5,
+  BL_CMD_JMP = 6,
+  BL_CMD_WRITE_WINDOWED = 7,
+  BL_CMD_HASHMAP = 8,
+  BL_CMD_DIGEST = 9,
+  BL_CMD_BOOT_CONFIG = 10,
+  BL_CMD_IMAGE = 11,
+  BL_CMD_STATS = 12,
+  BL_CMD_TRACE = 13,
+  BL_CMD_BATCH = 14,
+  BL_CMD_JOURNAL = 15,
+  BL_CMD_WRITE_DATA = 16 // Data chunk of a windowed write, dropped when no write is running
 } __attribute__((__packed__)) BLCommand_t;
 
+_Static_assert(STATS_COMMANDS == BL_CMD_WRITE_DATA + 1, "Every command needs a stats slot");
+
+typedef enum {
+  BL_WRITE_STATUS_OK = 0,           // Cumulative ACK, seq is the next expected chunk
+  BL_WRITE_STATUS_DONE = 1,         // All data has been written
+  BL_WRITE_STATUS_OUT_OF_ORDER = 2, // NACK, resend starting from seq
+  BL_WRITE_STATUS_OVERFLOW = 3,     // Final ACK instead of DONE, more data than announced was received and dropped
+  BL_WRITE_STATUS_CORRUPT = 4,      // The compressed or sparse data could not be decoded, write aborted
+  BL_WRITE_STATUS_BAD_CRC = 5,      // A chunk was damaged, seq is the first missing chunk
+  BL_WRITE_STATUS_GAPS = 6,         // WriteGapsOut_t with the chunks that are missing
+  BL_WRITE_STATUS_UNSUPPORTED = 7   // The write can't be done with these flags, this many chunks or outside the application area
+} __attribute__((__packed__)) BLWriteStatus_t;
+
 typedef struct {
   BLCommand_t cmd;
   uint8_t data[BL_PAYLOAD - sizeof(BLCommand_t)];
@@ -54,6 +133,18 @@ typedef struct {
   uint8_t version;
 } __attribute__((__packed__)) VersionOut_t;
 
+typedef struct {
+  uint8_t version;
+  uint16_t mtu; // Max size of a CPX packet, including its header
+  uint16_t maxChunkSize; // Max data in one chunk of a windowed write
+  uint8_t windowMax; // Max chunks in flight in a windowed write
+  uint32_t sectorSize; // Erase sector size of the flash
+  uint32_t flashSize;
+  uint32_t appStart; // Where the application image starts in flash
+  uint32_t features; // BL_FEATURE_*
+  uint32_t appEnd; // Where the metadata starts, images must end before it
+} __attribute__((__packed__)) InfoOut_t;
+
 typedef struct {
   uint32_t start;
   uint32_t size;
@@ -63,13 +154,213 @@ typedef struct {
   uint8_t md5[16];
 } __attribute__((__packed__)) MD5Out_t;
 
+typedef struct {
+  uint8_t ok; // 0 if the range is outside the application area or couldn't be kept
+  uint16_t sectors; // Sectors that were erased
+  uint32_t kept; // Bytes outside the range that were programmed back
+  uint16_t skipped; // Sectors that were already erased
+} __attribute__((__packed__)) EraseOut_t;
+
+typedef struct {
+  uint32_t start;
+  uint32_t size;
+  uint32_t blockSize; // 0 for one digest per flash page
+} __attribute__((__packed__)) HashMapIn_t;
+
+typedef struct {
+  uint32_t start;
+  uint32_t size;
+  digest_algorithm_t algorithm;
+  uint16_t blockSize; // Size of each flash read, 0 for the default
+} __attribute__((__packed__)) DigestIn_t;
+
+typedef struct {
+  digest_algorithm_t algorithm; // DIGEST_NONE if not supported
+  uint8_t digest[DIGEST_MAX_SIZE];
+} __attribute__((__packed__)) DigestOut_t;
+
+typedef struct {
+  uint32_t start;
+  uint32_t size;
+  uint8_t window; // Requested number of chunks in flight
+  uint8_t flags;
+  digest_algorithm_t algorithm; // Used with BL_WRITE_FLAG_VERIFY
+  uint16_t chunkSize; // Used with BL_WRITE_FLAG_CRC, all chunks but the last are this size
+} __attribute__((__packed__)) WriteWindowedIn_t;
+
+// Chunks are marked so the ones still in flight when a write has ended are
+// not taken as commands
+typedef struct {
+  BLCommand_t cmd; // BL_CMD_WRITE_DATA
+  uint16_t seq;
+  uint8_t data[BL_PAYLOAD - sizeof(BLCommand_t) - sizeof(uint16_t)];
+} __attribute__((__packed__)) WriteChunk_t;
+
+// Chunk of a write with BL_WRITE_FLAG_CRC, chunk seq is written at offset
+typedef struct {
+  BLCommand_t cmd; // BL_CMD_WRITE_DATA
+  uint32_t crc; // CRC32 of the rest of the chunk after it, including seq and offset
+  uint16_t seq;
+  uint32_t offset;
+  uint8_t data[];
+} __attribute__((__packed__)) WriteCrcChunk_t;
+
+typedef struct {
+  uint16_t seq;
+  BLWriteStatus_t status;
+  uint8_t window; // Granted number of chunks in flight
+} __attribute__((__packed__)) WriteAckOut_t;
+
+// Missing chunks of a write with BL_WRITE_FLAG_CRC, ack.seq is the first one
+typedef struct {
+  WriteAckOut_t ack;
+  uint8_t missing[]; // Bit n set if chunk ack.seq + n is missing
+} __attribute__((__packed__)) WriteGapsOut_t;
+
+// Final ACK of a windowed write
+typedef struct {
+  WriteAckOut_t ack;
+  uint16_t erased; // Sectors erased for the write
+  uint16_t eraseSkipped; // Sectors not erased since they already were
+} __attribute__((__packed__)) WriteDoneOut_t;
+
+// Final ACK of a write with BL_WRITE_FLAG_VERIFY
+typedef struct {
+  WriteDoneOut_t done;
+  uint8_t verified; // All programmed data was read back correctly
+  digest_algorithm_t algorithm;
+  uint8_t digest[DIGEST_MAX_SIZE]; // Of the data read back from flash
+} __attribute__((__packed__)) WriteVerifyOut_t;
+
+// Progress of the latest write is stored each time the write passes a multiple
+// of this in flash, it must be a multiple of the sector size
+#define BL_JOURNAL_INTERVAL (0x100000)
+
+// Progress of the latest write. A write of the rest of the same area continues it.
+typedef struct {
+  uint32_t start;
+  uint32_t size;
+  uint32_t done; // Bytes from start that are programmed, up to a multiple of BL_JOURNAL_INTERVAL or size
+  uint32_t crc; // CRC32 of the done bytes, as they were programmed
+} __attribute__((__packed__)) BLWriteJournal_t;
+
+#define BL_BOOT_FLAG_AUTO (1 << 0) // Boot a valid image if no host shows up within hostWait
+
+// Used by bl_autoBootWait when the application shouldn't be started automatically
+#define BL_HOST_WAIT_FOREVER (0xFFFFFFFF)
+
+typedef struct {
+  uint16_t hostWait; // Time in ms to listen for a host before booting
+  uint8_t flags;
+} __attribute__((__packed__)) BLBootConfig_t;
+
+typedef struct {
+  uint8_t set; // Store config, otherwise only read the current one
+  BLBootConfig_t config;
+} __attribute__((__packed__)) BootConfigIn_t;
+
+// Describes the application image that was verified after it was written
+typedef struct {
+  uint32_t start;
+  uint32_t size; // 0 if there is no verified image
+  digest_algorithm_t algorithm;
+  uint8_t digest[DIGEST_MAX_SIZE];
+  uint32_t headerCrc; // CRC32 of the binary header, checked when booting
+  uint32_t entry;
+  uint8_t nSegments;
+} __attribute__((__packed__)) BLImageDescriptor_t;
+
+typedef struct {
+  uint8_t set; // Verify the image against digest and store its descriptor
+  uint32_t start;
+  uint32_t size;
+  digest_algorithm_t algorithm;
+  uint8_t digest[DIGEST_MAX_SIZE];
+} __attribute__((__packed__)) ImageIn_t;
+
+typedef struct {
+  uint8_t reset; // Clear the counters after reading them
+} __attribute__((__packed__)) StatsIn_t;
+
+typedef struct {
+  stats_entry_t entries[STATS_COUNT];
+} __attribute__((__packed__)) StatsOut_t;
+
+typedef struct {
+  uint8_t clear; // Clear the trace after reading it
+} __attribute__((__packed__)) TraceIn_t;
+
+// The trace is sent in as many packets as needed, until index plus the
+// number of events in the packet is total
+typedef struct {
+  uint16_t index; // Of the first event in this packet
+  uint16_t total;
+  trace_event_t events[];
+} __attribute__((__packed__)) TraceOut_t;
+
+// A batch is a list of commands that each have a single reply, they are run
+// in order and answered with one packet
+typedef struct {
+  uint8_t size; // Of data
+  BLCommand_t cmd;
+  uint8_t data[];
+} __attribute__((__packed__)) BatchEntryIn_t;
+
+typedef struct {
+  uint8_t count;
+  uint8_t entries[]; // BatchEntryIn_t
+} __attribute__((__packed__)) BatchIn_t;
+
+typedef struct {
+  BLCommand_t cmd;
+  uint16_t size; // Of data, 0 if the command can't be batched
+  uint8_t data[];
+} __attribute__((__packed__)) BatchEntryOut_t;
+
+typedef struct {
+  uint8_t count; // Commands run, the rest didn't fit in the reply
+  uint8_t entries[]; // BatchEntryOut_t
+} __attribute__((__packed__)) BatchOut_t;
+
+// Set up what the bootloader logic shares with the other modules
+void bl_init(void);
+
 uint16_t bl_handleVersionCommand(VersionOut_t * info);
 
-void bl_handleReadCommand(ReadIn_t * info,  CPXPacket_t * txp);
+uint16_t bl_handleInfoCommand(InfoOut_t * info);
+
+// Get an empty packet from the pool with the routing for replies
+CPXPacket_t * bl_allocReply(const CPXRouting_t * route);
+
+void bl_handleReadCommand(ReadIn_t * info, const CPXRouting_t * route);
 
-void bl_handleWriteCommand(ReadIn_t * info,  CPXPacket_t * rxp, CPXPacket_t * txp);
+void bl_handleWriteCommand(ReadIn_t * info);
+
+void bl_handleWriteWindowedCommand(WriteWindowedIn_t * info, const CPXRouting_t * route);
 
 uint32_t bl_handleMD5Command(ReadIn_t * info, MD5Out_t * dataout);
 
+uint32_t bl_handleDigestCommand(DigestIn_t * info, DigestOut_t * dataout);
+
+void bl_handleHashMapCommand(HashMapIn_t * info, const CPXRouting_t * route);
+
+uint16_t bl_handleEraseCommand(ReadIn_t * info, EraseOut_t * dataout);
+
+uint16_t bl_handleJournalCommand(BLWriteJournal_t * dataout);
+
+uint16_t bl_handleBootConfigCommand(BootConfigIn_t * info, BLBootConfig_t * dataout);
+
+uint16_t bl_handleImageCommand(ImageIn_t * info, BLImageDescriptor_t * dataout);
+
+// Time in ms to listen for a host before booting the application, or
+// BL_HOST_WAIT_FOREVER if it should only be booted by BL_CMD_JMP
+uint32_t bl_autoBootWait(void);
+
+uint16_t bl_handleStatsCommand(StatsIn_t * info, StatsOut_t * dataout);
+
+void bl_handleTraceCommand(TraceIn_t * info, const CPXRouting_t * route);
+
+uint16_t bl_handleBatchCommand(BatchIn_t * info, BatchOut_t * dataout);
+
 void bl_boot_to_application(void);
 #endif
\ No newline at end of file
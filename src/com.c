@@ -28,6 +28,8 @@
 
 #include "pmsis.h"
 #include "com.h"
+#include "stats.h"
+#include "trace.h"
 
 #define max(a, b)               \
   (                             \
@@ -62,23 +64,35 @@ static pi_gpio_callback_t cb_gpio;
 
 static pi_device_t spi_dev, nina_rtt_dev, gap8_rtt_dev;
 
-// Queues for interacting with COM layer
+// Queues for interacting with COM layer, these pass pointers to packets
+// in the pool so the packets are never copied
 static QueueHandle_t txq = NULL;
 static QueueHandle_t rxq = NULL;
+static QueueHandle_t freeq = NULL;
 
 // To optimize sending the queue should fit at least one image
 #define TXQ_SIZE (1)
 #define RXQ_SIZE (1)
 
+// Packets shared by the com, CPX and bootloader layers. This must fit what is
+// held at the same time: one being received and one in the rxq, one being
+// sent and one in the txq, plus the command and one packet the bootloader is
+// working on. A chunk is always freed before its ACK is taken, and a read
+// queues its packet before taking the next.
+#define POOL_SIZE (6)
+
 static EventGroupHandle_t evGroup;
 #define NINA_RTT_BIT (1 << 0)
 #define TX_QUEUE_BIT (1 << 1)
 
 #define INITIAL_TRANSFER_SIZE (4)
 
+#define COM_STACK_DEPTH (configMINIMAL_STACK_SIZE * 6)
+
 void vDataReadyISR(void *args)
 {
   BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  trace_log(TRACE_RTT_EDGE, 0, 0);
   xEventGroupSetBitsFromISR(evGroup, NINA_RTT_BIT, &xHigherPriorityTaskWoken);
   portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
@@ -145,13 +159,74 @@ static void init_spi(pi_device_t *device)
 static uint32_t start;
 static uint32_t end;
 
-static uint8_t rx_buff[sizeof(packet_t)];
-static uint8_t tx_buff[sizeof(packet_t)];
+// These must be in L2 for uDMA to work
+static packet_t pool[POOL_SIZE];
+
+// Sent when there's nothing to send, the length is always 0
+static packet_t idle;
+
+static void transfer(packet_t *tx_packet, packet_t *rx_packet)
+{
+  uint32_t spiStart;
+  uint8_t * tx_buff = (uint8_t *) tx_packet;
+  uint8_t * rx_buff = (uint8_t *) rx_packet;
+
+  trace_log(TRACE_SPI_START, 0, tx_packet->len);
+  spiStart = stats_now();
+  pi_spi_transfer(&spi_dev, 
+                  tx_buff,
+                  rx_buff,
+                  INITIAL_TRANSFER_SIZE * 8,
+                  PI_SPI_LINES_SINGLE | PI_SPI_CS_KEEP);
+  stats_add(STATS_SPI_TRANSFER, spiStart);
+
+  int tx_len = tx_packet->len;
+  int rx_len = rx_packet->len;
+
+  DEBUG_PRINTF("Should read %i bytes\n", rx_len);
+
+  int sizeLeft = max(tx_len - INITIAL_TRANSFER_SIZE + 2, rx_len - INITIAL_TRANSFER_SIZE + 2);
+
+  DEBUG_PRINTF("Transfer size left is %i\n", sizeLeft);
+
+  // Set minumum size left, this works with 0 bytes as well
+  sizeLeft = max(0, sizeLeft);
+
+  // We only support transfers which are multiples of 4
+  if ((sizeLeft % 4) > 0) {
+    sizeLeft += (4-sizeLeft%4); // Pad upwards
+  }
+
+  // Protect against the case where the ESP might signal
+  // on the RTT line that it wants to send, but actually has
+  // no length. Calling the SPI transfer function with size = 0
+  // will corrupt the following transaction. Sending random data
+  // is ok, since the length is set to 0 and the ESP will ignore it.
+  if (sizeLeft == 0) {
+    sizeLeft = 4;
+  }
+
+  DEBUG_PRINTF("Sending %i bytes\n", sizeLeft);
+
+  // Set GAP8 RTT low before we end the transfer
+  set_gap8_rtt_pin(&gap8_rtt_dev, GPIO_LOW);
+
+  // Transfer the remaining bytes
+  spiStart = stats_now();
+  pi_spi_transfer(&spi_dev,
+                  &tx_buff[INITIAL_TRANSFER_SIZE],
+                  &rx_buff[INITIAL_TRANSFER_SIZE],
+                  sizeLeft * 8,
+                  PI_SPI_LINES_SINGLE | PI_SPI_CS_AUTO);
+  stats_add(STATS_SPI_TRANSFER, spiStart);
+  trace_log(TRACE_SPI_END, 0, rx_packet->len);
+}
 
 void com_task(void *parameters)
 {
   EventBits_t evBits;
   uint32_t startupESPRTTValue;
+  packet_t * rx_packet = NULL;
 
   DEBUG_PRINTF("Starting com task\n");
 
@@ -187,18 +262,15 @@ void com_task(void *parameters)
       DEBUG_PRINTF("We were awakened by Nina RTT\n");
     }
 
+    packet_t * tx_packet = &idle;
     if (uxQueueMessagesWaiting(txq) > 0)
     {
-      xQueueReceive(txq, tx_buff, 0);
-      DEBUG_PRINTF("Should send packet of size %i\n", ((packet_t *)tx_buff)->len);
-    }
-    else 
-    {
-      memset(tx_buff, 0, sizeof(packet_t));
+      xQueueReceive(txq, &tx_packet, 0);
+      DEBUG_PRINTF("Should send packet of size %i\n", tx_packet->len);
     }
 
-    // Check if we have a package to send (all 0 otherwise)
-    if (((packet_t *)tx_buff)->len > 0)
+    // Check if we have a package to send (idle packet with length 0 otherwise)
+    if (tx_packet->len > 0)
     {
       set_gap8_rtt_pin(&gap8_rtt_dev, GPIO_HIGH);
       // Check if Nina RTT was set at the same time, if not wait
@@ -210,69 +282,40 @@ void com_task(void *parameters)
         DEBUG_PRINTF("Nina RTT already high\n");
       }
     }
-    //memset(rx_buff, 0x01, sizeof(packet_t));
     // There's a risk that we've been emptying the queue while another package has been
     // pushed and set the event bit again, which will trigger this loop again.
     // To avoid one extra read (that's not needed) double check here.
-    if ((evBits & NINA_RTT_BIT) == NINA_RTT_BIT || ((packet_t *)tx_buff)->len > 0) {
+    if ((evBits & NINA_RTT_BIT) == NINA_RTT_BIT || tx_packet->len > 0) {
       DEBUG_PRINTF("Initiating SPI tansfer\n");
 
-      pi_spi_transfer(&spi_dev, 
-                      tx_buff,
-                      rx_buff,
-                      INITIAL_TRANSFER_SIZE * 8,
-                      PI_SPI_LINES_SINGLE | PI_SPI_CS_KEEP);
-
-      int tx_len = ((packet_t *)tx_buff)->len;
-      int rx_len = ((packet_t *)rx_buff)->len;
-
-      DEBUG_PRINTF("Should read %i bytes\n", rx_len);
-
-      int sizeLeft = max(tx_len - INITIAL_TRANSFER_SIZE + 2, rx_len - INITIAL_TRANSFER_SIZE + 2);
-
-      DEBUG_PRINTF("Transfer size left is %i\n", sizeLeft);
-
-      // Set minumum size left, this works with 0 bytes as well
-      sizeLeft = max(0, sizeLeft);
-
-      // We only support transfers which are multiples of 4
-      if ((sizeLeft % 4) > 0) {
-        sizeLeft += (4-sizeLeft%4); // Pad upwards
+      // Keep the same buffer until something is actually received in it
+      if (rx_packet == NULL) {
+        rx_packet = com_alloc();
       }
 
-      // Protect against the case where the ESP might signal
-      // on the RTT line that it wants to send, but actually has
-      // no length. Calling the SPI transfer function with size = 0
-      // will corrupt the following transaction. Sending random data
-      // is ok, since the length is set to 0 and the ESP will ignore it.
-      if (sizeLeft == 0) {
-        sizeLeft = 4;
-      }
-
-      DEBUG_PRINTF("Sending %i bytes\n", sizeLeft);
-
-      // Set GAP8 RTT low before we end the transfer
-      set_gap8_rtt_pin(&gap8_rtt_dev, GPIO_LOW);
+      transfer(tx_packet, rx_packet);
 
-      // Transfer the remaining bytes
-      pi_spi_transfer(&spi_dev,
-                      &tx_buff[INITIAL_TRANSFER_SIZE],
-                      &rx_buff[INITIAL_TRANSFER_SIZE],
-                      sizeLeft * 8,
-                      PI_SPI_LINES_SINGLE | PI_SPI_CS_AUTO);
+      DEBUG_PRINTF("Read %i bytes\n", rx_packet->len);
 
-      DEBUG_PRINTF("Read %i bytes\n", ((packet_t *)rx_buff)->len);
-
-      if (((packet_t *)rx_buff)->len > 0)
+      if (rx_packet->len > 0)
       {
-        if (xQueueSend(rxq, ((packet_t *)rx_buff), (TickType_t)portMAX_DELAY) != pdPASS)
+        if (uxQueueSpacesAvailable(rxq) == 0) {
+          trace_log(TRACE_RX_QUEUE_WAIT, 0, 0);
+        }
+        if (xQueueSend(rxq, &rx_packet, (TickType_t)portMAX_DELAY) != pdPASS)
         {
           DEBUG_PRINTF("RX Queue full!\n");
         } else {
           DEBUG_PRINTF("Queued packet\n");
+          trace_log(TRACE_RX_QUEUED, 0, rx_packet->len);
+          rx_packet = NULL;
         }
       }
 
+      if (tx_packet != &idle) {
+        com_free(tx_packet);
+      }
+
       // Do not wait for Nina RTT to go low, we trigger on rising edge anyway
     } else {
       // For debug
@@ -288,39 +331,80 @@ void com_init()
   setup_gap8_rtt_pin(&gap8_rtt_dev);
   init_spi(&spi_dev);
 
-  txq = xQueueCreate(TXQ_SIZE, sizeof(packet_t));
-  rxq = xQueueCreate(RXQ_SIZE, sizeof(packet_t));
+  txq = xQueueCreate(TXQ_SIZE, sizeof(packet_t *));
+  rxq = xQueueCreate(RXQ_SIZE, sizeof(packet_t *));
+  freeq = xQueueCreate(POOL_SIZE, sizeof(packet_t *));
 
-  if (txq == NULL || rxq == NULL)
+  if (txq == NULL || rxq == NULL || freeq == NULL)
   {
-    printf("Could not allocate txq and/or rxq in com\n");
+    printf("Could not allocate txq, rxq and/or freeq in com\n");
     pmsis_exit(1);
   }
 
+  for (int i = 0; i < POOL_SIZE; i++)
+  {
+    com_free(&pool[i]);
+  }
+
   evGroup = xEventGroupCreate();
 
   BaseType_t xTask;
-  xTask = xTaskCreate(com_task, "com_task", configMINIMAL_STACK_SIZE * 6,
-                      NULL, tskIDLE_PRIORITY + 1, NULL);
+  TaskHandle_t task;
+  xTask = xTaskCreate(com_task, "com_task", COM_STACK_DEPTH,
+                      NULL, tskIDLE_PRIORITY + 1, &task);
   if (xTask != pdPASS)
   {
     DEBUG_PRINTF("COM task did not start !\n");
     pmsis_exit(-1);
   }
+  stats_task(STATS_STACK_COM, task, COM_STACK_DEPTH);
 
   setup_nina_rtt_pin(&nina_rtt_dev);
 }
 
-void com_read(packet_t *p)
+packet_t * com_alloc(void)
+{
+  packet_t *p;
+  xQueueReceive(freeq, &p, (TickType_t)portMAX_DELAY);
+  return p;
+}
+
+void com_free(packet_t *p)
+{
+  xQueueSend(freeq, &p, 0);
+}
+
+packet_t * com_read(void)
+{
+  packet_t *p;
+  uint32_t waitStart = stats_now();
+  xQueueReceive(rxq, &p, (TickType_t)portMAX_DELAY);
+  stats_add(STATS_COM_READ_WAIT, waitStart);
+  return p;
+}
+
+packet_t * com_read_timeout(uint32_t timeout)
 {
-  xQueueReceive(rxq, p, (TickType_t)portMAX_DELAY);
+  packet_t *p;
+  uint32_t waitStart = stats_now();
+  if (xQueueReceive(rxq, &p, timeout / portTICK_PERIOD_MS) != pdTRUE) {
+    return NULL;
+  }
+  stats_add(STATS_COM_READ_WAIT, waitStart);
+  return p;
 }
 
 void com_write(packet_t *p)
 {
   start = xTaskGetTickCount();
   //printf("Will queue up packet\n");
-  xQueueSend(txq, p, (TickType_t)portMAX_DELAY);
+  uint32_t waitStart = stats_now();
+  if (uxQueueSpacesAvailable(txq) == 0) {
+    trace_log(TRACE_TX_QUEUE_WAIT, 0, 0);
+  }
+  xQueueSend(txq, &p, (TickType_t)portMAX_DELAY);
+  stats_add(STATS_COM_WRITE_WAIT, waitStart);
+  trace_log(TRACE_TX_QUEUED, 0, p->len);
   //printf("Have queued up packet!\n");
   xEventGroupSetBits(evGroup, TX_QUEUE_BIT);
 }
@@ -41,8 +41,19 @@ typedef struct
 /* Initialize the communication */
 void com_init();
 
-void com_read(packet_t * p);
+/* Get an empty packet from the pool, blocks until one is free */
+packet_t * com_alloc(void);
 
+/* Give back a packet to the pool */
+void com_free(packet_t * p);
+
+/* Get the next received packet, it must be freed by the caller */
+packet_t * com_read(void);
+
+/* As com_read but gives up after timeout ms and returns NULL */
+packet_t * com_read_timeout(uint32_t timeout);
+
+/* Queue a packet for sending, it's freed by com once it has been sent */
 void com_write(packet_t * p);
 
 #endif
\ No newline at end of file
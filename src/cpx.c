@@ -29,49 +29,83 @@
 #include "com.h"
 #include "pmsis.h"
 #include "cpx.h"
+#include "stats.h"
+#include "trace.h"
 
-typedef struct
-{
-  uint16_t length; // Length data from cpxDst
-  uint8_t cpxDst : 3;
-  uint8_t cpxSrc : 3;
-  bool lastPacket : 1;
-  bool reserved : 1;
-  uint8_t cpxFunc;
-  uint8_t data[MTU - CPX_HEADER_SIZE];
-} __attribute__((packed)) spi_transport_with_routing_packet_t;
+#if 0
+#define DEBUG_PRINTF printf
+#else
+#define DEBUG_PRINTF(...) ((void) 0)
+#endif
 
-static spi_transport_with_routing_packet_t txp;
-static spi_transport_with_routing_packet_t rxp;
+CPXPacket_t * cpxAllocPacket(void) {
+  return (CPXPacket_t *) com_alloc();
+}
+
+void cpxFreePacket(CPXPacket_t * packet) {
+  com_free((packet_t *) packet);
+}
+
+// Packets too short to hold the CPX header or longer than the buffer are
+// dropped, so the length of the data is always within the packet
+static bool is_malformed(CPXPacket_t * packet) {
+  if (packet->length >= CPX_HEADER_SIZE && packet->length <= MTU) {
+    return false;
+  }
+  DEBUG_PRINTF("Dropping packet with length %u\n", packet->length);
+  stats_count(STATS_COM_RX_DROPPED);
+  cpxFreePacket(packet);
+  return true;
+}
 
 // Return length of packet
-uint32_t cpxReceivePacketBlocking(CPXPacket_t * packet) {
-  com_read((packet_t*) &rxp);
-  uint32_t size = rxp.length - sizeof(CPXRouting_t);
+uint32_t cpxReceivePacketBlocking(CPXPacket_t ** packet) {
+  do {
+    *packet = (CPXPacket_t *) com_read();
+  } while (is_malformed(*packet));
+  trace_log(TRACE_CPX_RECEIVE, (*packet)->route.function, (*packet)->length);
 
-  size = (uint32_t) rxp.length - CPX_HEADER_SIZE;
-  packet->route.destination = rxp.cpxDst;
-  packet->route.source = rxp.cpxSrc;
-  packet->route.function = rxp.cpxFunc;
-  memcpy(packet->data, rxp.data, size);
+  return (uint32_t) (*packet)->length - CPX_HEADER_SIZE;
+}
+
+uint32_t cpxReceivePacketTimeout(CPXPacket_t ** packet, uint32_t timeout) {
+  TickType_t start = xTaskGetTickCount();
+  uint32_t left = timeout;
+
+  while (1) {
+    *packet = (CPXPacket_t *) com_read_timeout(left);
 
-  return size;
+    if (*packet == NULL) {
+      return 0;
+    }
+    if (!is_malformed(*packet)) {
+      break;
+    }
+
+    uint32_t waited = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+    left = waited < timeout ? timeout - waited : 0;
+  }
+  trace_log(TRACE_CPX_RECEIVE, (*packet)->route.function, (*packet)->length);
+  return (uint32_t) (*packet)->length - CPX_HEADER_SIZE;
 }
 
-static CPXPacket_t consoleTx;
 void cpxPrintToConsole(CPXConsoleTarget_t target, const char * fmt, ...) {
   va_list ap;
   int len;
 
+  CPXPacket_t * consoleTx = cpxAllocPacket();
+
   va_start(ap, fmt);
-  len = vsnprintf(consoleTx.data, sizeof(consoleTx.data), fmt, ap);
+  len = vsnprintf(consoleTx->data, sizeof(consoleTx->data), fmt, ap);
   va_end(ap);
 
-  consoleTx.route.destination = target;
-  consoleTx.route.source = GAP8;
-  consoleTx.route.function = CONSOLE;
+  consoleTx->route.destination = target;
+  consoleTx->route.source = GAP8;
+  consoleTx->route.function = CONSOLE;
+  consoleTx->route.lastPacket = false;
+  consoleTx->route.reserved = false;
 
-  cpxSendPacketBlocking(&consoleTx, len + 1);
+  cpxSendPacketBlocking(consoleTx, len + 1);
 }
 
 void cpxSendPacketBlocking(CPXPacket_t * packet, uint32_t size) {
@@ -80,11 +114,8 @@ void cpxSendPacketBlocking(CPXPacket_t * packet, uint32_t size) {
   ASSERT((packet->route.function >> 8) == 0);
   ASSERT(size <= MTU - CPX_HEADER_SIZE);*/
 
-  txp.length = (uint16_t) size + CPX_HEADER_SIZE;
-  txp.cpxDst = packet->route.destination;
-  txp.cpxSrc = packet->route.source;
-  txp.cpxFunc = packet->route.function;
-  memcpy(txp.data, &packet->data, size);
+  packet->length = (uint16_t) size + CPX_HEADER_SIZE;
+  trace_log(TRACE_CPX_SEND, packet->route.function, packet->length);
 
-  com_write((packet_t*) &txp);
+  com_write((packet_t*) packet);
 }
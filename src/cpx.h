@@ -56,20 +56,36 @@ typedef enum {
   LOG_TO_CRTP = STM32
 } CPXConsoleTarget_t;
 
+// The packets are stored with the CPX header in place, in the same layout
+// as they are transferred, so they can be passed between layers by pointer
 typedef struct {
-  CPXTarget_t destination;
-  CPXTarget_t source;
-  CPXFunction_t function;
-} CPXRouting_t;
+  CPXTarget_t destination : 3;
+  CPXTarget_t source : 3;
+  bool lastPacket : 1;
+  bool reserved : 1;
+  CPXFunction_t function : 8;
+} __attribute__((packed)) CPXRouting_t;
 
 typedef struct {
-    CPXRouting_t route;
-    uint8_t data[MTU-2];
-} CPXPacket_t;
+  uint16_t length; // Length of route and data
+  CPXRouting_t route;
+  uint8_t data[MTU - CPX_HEADER_SIZE];
+} __attribute__((packed)) CPXPacket_t;
 
-// Return length of packet
-uint32_t cpxReceivePacketBlocking(CPXPacket_t * packet);
+// Get an empty packet from the pool, blocks until one is free
+CPXPacket_t * cpxAllocPacket(void);
 
+// Give back a packet that is not sent to the pool
+void cpxFreePacket(CPXPacket_t * packet);
+
+// Return length of packet, the packet must be freed by the caller
+uint32_t cpxReceivePacketBlocking(CPXPacket_t ** packet);
+
+// As cpxReceivePacketBlocking but *packet is NULL if nothing is received
+// within timeout ms
+uint32_t cpxReceivePacketTimeout(CPXPacket_t ** packet, uint32_t timeout);
+
+// The packet is handed over and must not be used after this
 void cpxSendPacketBlocking(CPXPacket_t * packet, uint32_t size);
 
 void cpxPrintToConsole(CPXConsoleTarget_t target, const char * fmt, ...);
@@ -0,0 +1,90 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * crc32.c - Table driven CRC32 (IEEE 802.3)
+ *
+ * Slice-by-4 uses four tables to process a word at a time. Slice-by-8 is a bit
+ * faster but the tables would take 8 KiB of L2 instead of 4 KiB.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "crc32.h"
+
+#define CRC32_POLYNOMIAL (0xEDB88320)
+
+static uint32_t table[4][256];
+static bool isInit = false;
+
+static void crc32_init(void) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int bit = 0; bit < 8; bit++) {
+      c = (c & 1) ? (c >> 1) ^ CRC32_POLYNOMIAL : c >> 1;
+    }
+    table[0][i] = c;
+  }
+
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int slice = 1; slice < 4; slice++) {
+      uint32_t prev = table[slice - 1][i];
+      table[slice][i] = (prev >> 8) ^ table[0][prev & 0xFF];
+    }
+  }
+
+  isInit = true;
+}
+
+uint32_t crc32_update(uint32_t crc, const uint8_t * data, uint32_t size) {
+  if (!isInit) {
+    crc32_init();
+  }
+
+  uint32_t c = ~crc;
+
+  // Bytewise until the data is word aligned
+  while (size > 0 && ((uintptr_t) data & 3) != 0) {
+    c = (c >> 8) ^ table[0][(c ^ *data++) & 0xFF];
+    size--;
+  }
+
+  // The GAP8 is little endian, so the first byte is in the low bits
+  while (size >= 4) {
+    c ^= *(const uint32_t *) data;
+    c = table[3][c & 0xFF] ^
+        table[2][(c >> 8) & 0xFF] ^
+        table[1][(c >> 16) & 0xFF] ^
+        table[0][c >> 24];
+    data += 4;
+    size -= 4;
+  }
+
+  while (size > 0) {
+    c = (c >> 8) ^ table[0][(c ^ *data++) & 0xFF];
+    size--;
+  }
+
+  return ~c;
+}
@@ -0,0 +1,87 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * digest.c - Common interface for the supported digests
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "crc32.h"
+#include "digest.h"
+
+bool digest_init(digest_ctx_t * ctx, digest_algorithm_t algorithm) {
+  ctx->algorithm = algorithm;
+
+  switch (algorithm) {
+    case DIGEST_MD5:
+      MD5_Init(&ctx->md5);
+      return true;
+    case DIGEST_CRC32:
+      ctx->crc32 = 0;
+      return true;
+    case DIGEST_SHA256:
+      sha256_init(&ctx->sha256);
+      return true;
+    default:
+      ctx->algorithm = DIGEST_NONE;
+      return false;
+  }
+}
+
+void digest_update(digest_ctx_t * ctx, const uint8_t * data, uint32_t size) {
+  switch (ctx->algorithm) {
+    case DIGEST_MD5:
+      MD5_Update(&ctx->md5, (void *) data, size);
+      break;
+    case DIGEST_CRC32:
+      ctx->crc32 = crc32_update(ctx->crc32, data, size);
+      break;
+    case DIGEST_SHA256:
+      sha256_update(&ctx->sha256, data, size);
+      break;
+    default:
+      break;
+  }
+}
+
+uint32_t digest_final(digest_ctx_t * ctx, uint8_t * digest) {
+  switch (ctx->algorithm) {
+    case DIGEST_MD5:
+      MD5_Final(digest, &ctx->md5);
+      return 16;
+    case DIGEST_CRC32:
+      // Little endian, same as on the GAP8
+      digest[0] = ctx->crc32;
+      digest[1] = ctx->crc32 >> 8;
+      digest[2] = ctx->crc32 >> 16;
+      digest[3] = ctx->crc32 >> 24;
+      return 4;
+    case DIGEST_SHA256:
+      sha256_final(&ctx->sha256, digest);
+      return SHA256_DIGEST_SIZE;
+    default:
+      return 0;
+  }
+}
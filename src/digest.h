@@ -0,0 +1,64 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * digest.h - Common interface for the supported digests
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bsp/crc/md5.h"
+
+#include "sha256.h"
+
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#define DIGEST_MAX_SIZE (SHA256_DIGEST_SIZE)
+
+typedef enum {
+  DIGEST_MD5 = 0,
+  DIGEST_CRC32 = 1,
+  DIGEST_SHA256 = 2,
+  DIGEST_NONE = 0xFF
+} __attribute__((__packed__)) digest_algorithm_t;
+
+typedef struct {
+  digest_algorithm_t algorithm;
+  union {
+    MD5_CTX md5;
+    uint32_t crc32;
+    sha256_ctx_t sha256;
+  };
+} digest_ctx_t;
+
+// Returns false if the algorithm isn't supported
+bool digest_init(digest_ctx_t * ctx, digest_algorithm_t algorithm);
+
+void digest_update(digest_ctx_t * ctx, const uint8_t * data, uint32_t size);
+
+// Returns the size of the digest
+uint32_t digest_final(digest_ctx_t * ctx, uint8_t * digest);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,410 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * erase.c - Background erase of flash sectors
+ *
+ * Erasing a sector takes a long time compared to receiving and programming
+ * the data for it. The erase task erases the sectors of a write session ahead
+ * of the write pointer, so the receiving side only has to wait if it catches
+ * up with it.
+ *
+ * The sectors are found from the sector map of the flash. When the area only
+ * covers part of a sector the rest of it is read to RAM before the sector is
+ * erased and programmed back after. Only blocks that aren't erased are kept,
+ * in a fixed buffer, and a sector is never erased if they don't fit in it.
+ *
+ * Sectors that are already erased, like on a new unit or after a chip erase,
+ * are found by reading them back and are not erased again. Reading a sector
+ * takes a few ms while erasing it takes seconds, and the read stops at the
+ * first byte that isn't erased.
+ */
+
+#include "pmsis.h"
+
+#include "flash.h"
+#include "erase.h"
+#include "stats.h"
+
+#if 0
+#define DEBUG_PRINTF printf
+#else
+#define DEBUG_PRINTF(...) ((void) 0)
+#endif /* DEBUG */
+
+// Keeping a sector waits for a read request and an erase task, both on the
+// stack, below the blank check and the collecting of the kept blocks
+#define ERASE_STACK_DEPTH (configMINIMAL_STACK_SIZE * 3)
+
+static SemaphoreHandle_t startSignal;
+static SemaphoreHandle_t progressSignal;
+
+// Next sector to erase and end of the current erase
+static volatile uint32_t eraseNext;
+static volatile uint32_t eraseEnd;
+static volatile bool busy;
+
+// Area of the current erase, eraseEnd is moved when aborting
+static uint32_t areaStart;
+static uint32_t areaEnd;
+
+// The last sector is erased right after the first when the rest of it has to
+// be kept, after that the keep buffer is free for the write
+#define NO_SECTOR (0xFFFFFFFF)
+static uint32_t lastSector;
+static volatile bool keeping;
+
+// Sectors erased and skipped since they were blank, by the current erase
+static volatile uint32_t erasedSectors;
+static volatile uint32_t skippedSectors;
+
+typedef enum {
+  SECTOR_ERASED,
+  SECTOR_BLANK,    // Already erased, nothing was done
+  SECTOR_NOT_KEPT  // Not erased since the rest of it didn't fit in the keep buffer
+} sector_result_t;
+
+// One block is checked while the uDMA reads the next
+#define BLANK_CHECK_BLOCK_SIZE (1024)
+static PI_L2 uint8_t blankBuffers[2][BLANK_CHECK_BLOCK_SIZE];
+
+// Blocks of the rest of a sector that aren't erased are kept in a buffer
+// shared with the writes while it's erased. The blocks are larger than the
+// reads that go through the cache.
+#define KEEP_BLOCK_SIZE (1024)
+#define KEEP_BLOCKS_MAX (8)
+static uint8_t * keepBuffer;
+static uint32_t keepBlocks;
+static uint32_t keepAddress[KEEP_BLOCKS_MAX];
+static uint32_t keepSize[KEEP_BLOCKS_MAX];
+
+static bool is_erased(const uint8_t * data, uint32_t size)
+{
+  for (uint32_t i = 0; i < size; i++) {
+    if (data[i] != 0xFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool is_blank(uint32_t start, uint32_t end)
+{
+  flash_request_t readRequest;
+  uint32_t address = start;
+  uint32_t size;
+  int current = 0;
+
+  if (start >= end) {
+    return true;
+  }
+
+  size = end - address < BLANK_CHECK_BLOCK_SIZE ? end - address : BLANK_CHECK_BLOCK_SIZE;
+  flash_read_submit(&readRequest, address, blankBuffers[current], size);
+  while (1) {
+    flash_request_wait(&readRequest);
+    uint8_t * data = blankBuffers[current];
+    uint32_t dataSize = size;
+
+    address += size;
+    bool more = address < end;
+    if (more) {
+      size = end - address < BLANK_CHECK_BLOCK_SIZE ? end - address : BLANK_CHECK_BLOCK_SIZE;
+      current = 1 - current;
+      flash_read_submit(&readRequest, address, blankBuffers[current], size);
+    }
+
+    if (!is_erased(data, dataSize)) {
+      if (more) {
+        flash_request_wait(&readRequest);
+      }
+      return false;
+    }
+
+    if (!more) {
+      return true;
+    }
+  }
+}
+
+// Add the blocks of [start, end) that aren't erased to the keep buffer after
+// the count already in it, returns false if they don't fit
+static bool collect_kept(uint32_t start, uint32_t end, uint32_t * count)
+{
+  for (uint32_t address = start; address < end; address += KEEP_BLOCK_SIZE) {
+    if (*count == keepBlocks) {
+      return is_blank(address, end);
+    }
+
+    uint8_t * block = &keepBuffer[*count * KEEP_BLOCK_SIZE];
+    uint32_t size = end - address < KEEP_BLOCK_SIZE ? end - address : KEEP_BLOCK_SIZE;
+    flash_read(address, block, size);
+    if (!is_erased(block, size)) {
+      keepAddress[*count] = address;
+      keepSize[*count] = size;
+      *count += 1;
+    }
+  }
+
+  return true;
+}
+
+// Check if the sector needs erasing for [start, end) and collect the rest of
+// it in the keep buffer
+static sector_result_t prepare_sector(uint32_t sectorStart, uint32_t sectorSize, uint32_t start, uint32_t end, uint32_t * count)
+{
+  uint32_t sectorEnd = sectorStart + sectorSize;
+  uint32_t areaStart = start > sectorStart ? start : sectorStart;
+  uint32_t tailStart = end < sectorEnd ? end : sectorEnd;
+
+  *count = 0;
+
+  // Only the part inside the area has to be erased
+  if (is_blank(areaStart, tailStart)) {
+    return SECTOR_BLANK;
+  }
+
+  if (!collect_kept(sectorStart, areaStart, count) || !collect_kept(tailStart, sectorEnd, count)) {
+    DEBUG_PRINTF("Can't keep the rest of sector @ 0x%X\n", sectorStart);
+    return SECTOR_NOT_KEPT;
+  }
+
+  return SECTOR_ERASED;
+}
+
+// Erase the sector and program back what is in it outside of [start, end)
+static sector_result_t erase_sector_keeping(uint32_t sectorStart, uint32_t sectorSize, uint32_t start, uint32_t end, uint32_t * kept)
+{
+  uint32_t count;
+
+  *kept = 0;
+
+  sector_result_t result = prepare_sector(sectorStart, sectorSize, start, end, &count);
+  if (result != SECTOR_ERASED) {
+    DEBUG_PRINTF("Not erasing flash sector @ 0x%X (%u)\n", sectorStart, result);
+    return result;
+  }
+
+  DEBUG_PRINTF("Erasing flash sector of %u @ 0x%X...\n", sectorSize, sectorStart);
+  flash_erase_sector(sectorStart);
+
+  for (uint32_t i = 0; i < count; i++) {
+    flash_write(keepAddress[i], &keepBuffer[i * KEEP_BLOCK_SIZE], keepSize[i]);
+    *kept += keepSize[i];
+  }
+
+  return SECTOR_ERASED;
+}
+
+static void erase_one(uint32_t sectorStart, uint32_t sectorSize)
+{
+  uint32_t kept;
+
+  // Writes are checked with erase_can_keep before they start, so a sector
+  // that can't be kept is only left as it is if it changed since then
+  sector_result_t result = erase_sector_keeping(sectorStart, sectorSize, areaStart, areaEnd, &kept);
+  if (result == SECTOR_BLANK) {
+    skippedSectors++;
+  } else if (result == SECTOR_ERASED) {
+    erasedSectors++;
+  }
+}
+
+static void erase_task(void *parameters)
+{
+  while (1) {
+    xSemaphoreTake(startSignal, portMAX_DELAY);
+
+    while (eraseNext < eraseEnd) {
+      uint32_t sectorStart;
+      uint32_t sectorSize;
+
+      flash_sector(eraseNext, &sectorStart, &sectorSize);
+      if (sectorStart != lastSector) {
+        erase_one(sectorStart, sectorSize);
+      }
+      eraseNext = sectorStart + sectorSize;
+
+      if (keeping) {
+        if (lastSector != NO_SECTOR && eraseNext < eraseEnd) {
+          flash_sector(lastSector, &sectorStart, &sectorSize);
+          erase_one(sectorStart, sectorSize);
+        }
+        keeping = false;
+      }
+      xSemaphoreGive(progressSignal);
+    }
+
+    DEBUG_PRINTF("Erase done\n");
+    keeping = false;
+    busy = false;
+    xSemaphoreGive(progressSignal);
+  }
+}
+
+void erase_init(uint8_t * buffer, uint32_t size)
+{
+  keepBuffer = buffer;
+  keepBlocks = size / KEEP_BLOCK_SIZE < KEEP_BLOCKS_MAX ? size / KEEP_BLOCK_SIZE : KEEP_BLOCKS_MAX;
+
+  startSignal = xSemaphoreCreateBinary();
+  progressSignal = xSemaphoreCreateBinary();
+
+  if (startSignal == NULL || progressSignal == NULL)
+  {
+    printf("Could not allocate erase signals\n");
+    pmsis_exit(1);
+  }
+
+  BaseType_t xTask;
+  TaskHandle_t task;
+  xTask = xTaskCreate(erase_task, "erase_task", ERASE_STACK_DEPTH,
+                      NULL, tskIDLE_PRIORITY + 1, &task);
+  if (xTask != pdPASS)
+  {
+    printf("Erase task did not start !\n");
+    pmsis_exit(-1);
+  }
+  stats_task(STATS_STACK_ERASE, task, ERASE_STACK_DEPTH);
+}
+
+void erase_start(uint32_t start, uint32_t size)
+{
+  erase_abort();
+
+  uint32_t sectorStart;
+  uint32_t sectorSize;
+  flash_sector(start, &sectorStart, &sectorSize);
+  eraseNext = sectorStart;
+  eraseEnd = size > 0 ? start + size : sectorStart;
+  areaStart = start;
+  areaEnd = start + size;
+  erasedSectors = 0;
+  skippedSectors = 0;
+
+  // Only a last sector that is partly covered has anything to keep
+  uint32_t firstSector = sectorStart;
+  lastSector = NO_SECTOR;
+  if (size > 0) {
+    flash_sector(areaEnd - 1, &sectorStart, &sectorSize);
+    if (sectorStart != firstSector && areaEnd < sectorStart + sectorSize) {
+      lastSector = sectorStart;
+    }
+  }
+  keeping = true;
+
+  DEBUG_PRINTF("Start background erase 0x%X-0x%X\n", eraseNext, eraseEnd);
+
+  busy = true;
+  xSemaphoreGive(startSignal);
+}
+
+void erase_wait(uint32_t end)
+{
+  if (!busy || eraseNext >= end) {
+    return;
+  }
+
+  uint32_t start = stats_now();
+  while (busy && eraseNext < end) {
+    xSemaphoreTake(progressSignal, portMAX_DELAY);
+  }
+  stats_add(STATS_ERASE_WAIT, start);
+}
+
+void erase_keep_wait(void)
+{
+  while (busy && keeping) {
+    xSemaphoreTake(progressSignal, portMAX_DELAY);
+  }
+}
+
+void erase_abort(void)
+{
+  eraseEnd = eraseNext;
+  while (busy) {
+    xSemaphoreTake(progressSignal, portMAX_DELAY);
+  }
+}
+
+void erase_counts(uint32_t * erased, uint32_t * skipped)
+{
+  *erased = erasedSectors;
+  *skipped = skippedSectors;
+}
+
+bool erase_range(uint32_t start, uint32_t size, uint32_t * erased, uint32_t * skipped, uint32_t * kept)
+{
+  uint32_t address = start;
+  uint32_t end = start + size;
+
+  erase_abort();
+
+  *erased = 0;
+  *skipped = 0;
+  *kept = 0;
+  while (address < end) {
+    uint32_t sectorStart;
+    uint32_t sectorSize;
+    uint32_t sectorKept;
+
+    flash_sector(address, &sectorStart, &sectorSize);
+    sector_result_t result = erase_sector_keeping(sectorStart, sectorSize, start, end, &sectorKept);
+    if (result == SECTOR_NOT_KEPT) {
+      return false;
+    }
+    if (result == SECTOR_BLANK) {
+      *skipped += 1;
+    } else {
+      *erased += 1;
+    }
+    *kept += sectorKept;
+    address = sectorStart + sectorSize;
+  }
+
+  return true;
+}
+
+bool erase_can_keep(uint32_t start, uint32_t size)
+{
+  uint32_t sectorStart;
+  uint32_t sectorSize;
+  uint32_t count;
+
+  if (size == 0) {
+    return true;
+  }
+
+  // The keep buffer is used by the erase task
+  erase_abort();
+
+  flash_sector(start, &sectorStart, &sectorSize);
+  if (prepare_sector(sectorStart, sectorSize, start, start + size, &count) == SECTOR_NOT_KEPT) {
+    return false;
+  }
+
+  uint32_t firstSector = sectorStart;
+  flash_sector(start + size - 1, &sectorStart, &sectorSize);
+  return sectorStart == firstSector ||
+         prepare_sector(sectorStart, sectorSize, start, start + size, &count) != SECTOR_NOT_KEPT;
+}
@@ -0,0 +1,67 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * erase.h - Background erase of flash sectors
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef __ERASE_H__
+#define __ERASE_H__
+
+// The rest of partly erased sectors is kept in buffer while they are erased,
+// it's shared with the writes, see erase_keep_wait
+void erase_init(uint8_t * buffer, uint32_t size);
+
+// Start erasing [start, start + size) in the background, any previous
+// unfinished erase is aborted. What is outside of the area in the first and
+// last sectors is kept, check that it can be with erase_can_keep first.
+void erase_start(uint32_t start, uint32_t size);
+
+// Block until all sectors of the current erase starting below end are erased
+void erase_wait(uint32_t end);
+
+// Block until the current erase is done with the keep buffer, which is once the
+// first and last sectors are erased
+void erase_keep_wait(void);
+
+// Stop the current erase after the sector in progress
+void erase_abort(void);
+
+// Sectors erased and sectors skipped since they were already erased, by the
+// current or latest erase started with erase_start
+void erase_counts(uint32_t * erased, uint32_t * skipped);
+
+// Erase [start, start + size) and wait for it, keeping what is outside of the
+// area in the first and last sectors. Sectors that are already erased are
+// skipped. Returns false if a sector couldn't be erased since what is in it
+// outside of the area didn't fit in the keep buffer.
+bool erase_range(uint32_t start, uint32_t size, uint32_t * erased, uint32_t * skipped, uint32_t * kept);
+
+// Returns false if what is outside of [start, start + size) in the first or
+// last sector is too much to keep when erasing it. Aborts any running erase.
+bool erase_can_keep(uint32_t start, uint32_t size);
+
+#endif
\ No newline at end of file
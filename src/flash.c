@@ -30,12 +30,54 @@
 #include <bsp/flash/hyperflash.h>
 
 #include "flash.h"
+#include "stats.h"
+#include "trace.h"
 
 static pi_device_t flash_dev;
 static struct pi_flash_info flash_info;
 static struct pi_hyperflash_conf flash_conf;
 static uint32_t flash_start;
 
+// The flash is shared between the bootloader and erase tasks
+static SemaphoreHandle_t flashLock;
+
+// Only the driver calls of a read or program, the programmed callback of the
+// combining runs in the task that reaps it
+#define FLASH_STACK_DEPTH (configMINIMAL_STACK_SIZE * 2)
+
+// Small reads go through a 2-way set associative cache of flash lines, the
+// fixed setup of each read dominates these. Lines are invalidated when
+// they're programmed or erased, which is all done here under the flash lock.
+#define CACHE_LINE_SIZE (64)
+#define CACHE_SETS (16)
+#define CACHE_WAYS (2)
+// Covers the binary header (272 bytes), the vector table and the meta records
+#define CACHE_READ_MAX (8 * CACHE_LINE_SIZE)
+#define CACHE_INVALID (0xFFFFFFFF)
+static PI_L2 uint8_t cacheLines[CACHE_SETS][CACHE_WAYS][CACHE_LINE_SIZE];
+static uint32_t cacheTags[CACHE_SETS][CACHE_WAYS];
+// Way to replace on the next miss in each set, the least recently used one
+static uint8_t cacheVictim[CACHE_SETS];
+
+// Requests waiting for the flash task
+static QueueHandle_t requestQueue;
+
+// Write combining, one buffer is filled while the other is being programmed.
+// The collected data of the current buffer is [combineStart, combineEnd),
+// which is at the same offset in the buffer as in the flash window it covers.
+#define COMBINE_SIZE (FLASH_BUFFER_SIZE * 2)
+static PI_L2 uint8_t combineBuffers[2][COMBINE_SIZE];
+static int combineCurrent;
+static uint32_t combineWindow;
+static uint32_t combineStart;
+static uint32_t combineEnd;
+static void (*combineProgrammed)(uint32_t addr, const uint8_t * data, uint32_t len);
+
+// Program of each buffer, only the buffer that isn't being filled can be in
+// flight
+static flash_request_t combineRequests[2];
+static bool combinePending[2];
+
 static void open_flash(pi_device_t *flash)
 {
   pi_hyperflash_conf_init(&flash_conf);
@@ -48,20 +90,278 @@ static void open_flash(pi_device_t *flash)
   }
 }
 
+static void cache_invalidate(uint32_t addr, uint32_t len) {
+  uint32_t start = addr / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+  for (int set = 0; set < CACHE_SETS; set++) {
+    for (int way = 0; way < CACHE_WAYS; way++) {
+      if (cacheTags[set][way] >= start && cacheTags[set][way] < addr + len) {
+        cacheTags[set][way] = CACHE_INVALID;
+      }
+    }
+  }
+}
+
+// Read from the flash, which must be locked
+static void read_locked(uint32_t addr, uint8_t * out_data, unsigned int len) {
+  uint32_t start = stats_now();
+  pi_flash_read(&flash_dev, addr, out_data, len);
+  stats_add(STATS_FLASH_READ, start);
+}
+
+// Read through the cache, which must be locked
+static void cache_read(uint32_t addr, uint8_t * out_data, unsigned int len) {
+  while (len > 0) {
+    uint32_t line = addr / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    int set = (line / CACHE_LINE_SIZE) % CACHE_SETS;
+    int way;
+
+    for (way = 0; way < CACHE_WAYS; way++) {
+      if (cacheTags[set][way] == line) {
+        break;
+      }
+    }
+
+    if (way == CACHE_WAYS) {
+      way = cacheVictim[set];
+      read_locked(line, cacheLines[set][way], CACHE_LINE_SIZE);
+      cacheTags[set][way] = line;
+    }
+    cacheVictim[set] = 1 - way;
+
+    uint32_t offset = addr - line;
+    uint32_t size = CACHE_LINE_SIZE - offset < len ? CACHE_LINE_SIZE - offset : len;
+    memcpy(out_data, &cacheLines[set][way][offset], size);
+    out_data += size;
+    addr += size;
+    len -= size;
+  }
+}
+
+static void flash_task(void *parameters) {
+  flash_request_t * request;
+
+  while (1) {
+    xQueueReceive(requestQueue, &request, portMAX_DELAY);
+
+    switch (request->op) {
+      case FLASH_OP_READ:
+        trace_log(TRACE_READ_START, 0, request->len);
+        flash_read(request->addr, request->data, request->len);
+        trace_log(TRACE_READ_END, 0, 0);
+        break;
+      case FLASH_OP_PROGRAM:
+        trace_log(TRACE_PROGRAM_START, 0, request->len);
+        flash_write(request->addr, request->data, request->len);
+        trace_log(TRACE_PROGRAM_END, 0, 0);
+        break;
+    }
+
+    // The owner may reuse the request as soon as it's completed
+    TaskHandle_t owner = request->owner;
+    request->completed = true;
+    xTaskNotifyGive(owner);
+  }
+}
+
 void flash_init() {
   open_flash(&flash_dev);
 
   pi_flash_ioctl(&flash_dev, PI_FLASH_IOCTL_INFO, (void *)&flash_info);
+
+  for (int set = 0; set < CACHE_SETS; set++) {
+    for (int way = 0; way < CACHE_WAYS; way++) {
+      cacheTags[set][way] = CACHE_INVALID;
+    }
+  }
+
+  flashLock = xSemaphoreCreateMutex();
+  requestQueue = xQueueCreate(FLASH_QUEUE_LENGTH, sizeof(flash_request_t *));
+  if (flashLock == NULL || requestQueue == NULL)
+  {
+    printf("Could not allocate flash lock\n");
+    pmsis_exit(PI_FAIL);
+  }
+
+  // Above the bootloader task, so the next queued request is started as soon
+  // as the flash is done with the previous one
+  BaseType_t xTask;
+  TaskHandle_t task;
+  xTask = xTaskCreate(flash_task, "flash_task", FLASH_STACK_DEPTH,
+                      NULL, tskIDLE_PRIORITY + 2, &task);
+  if (xTask != pdPASS)
+  {
+    printf("Flash task did not start !\n");
+    pmsis_exit(PI_FAIL);
+  }
+  stats_task(STATS_STACK_FLASH, task, FLASH_STACK_DEPTH);
+}
+
+uint32_t flash_sector_size(void) {
+  return flash_info.sector_size;
+}
+
+void flash_sector(uint32_t addr, uint32_t * start, uint32_t * size) {
+  *start = addr / flash_info.sector_size * flash_info.sector_size;
+  *size = flash_info.sector_size;
+}
+
+static void lock_flash(void) {
+  uint32_t start = stats_now();
+  xSemaphoreTake(flashLock, portMAX_DELAY);
+  stats_add(STATS_FLASH_LOCK_WAIT, start);
 }
 
 void flash_write(uint32_t addr, uint8_t * in_data, unsigned int len) {
+  lock_flash();
+  cache_invalidate(addr, len);
+  uint32_t start = stats_now();
   pi_flash_program(&flash_dev, addr, in_data, len);
+  stats_add(STATS_FLASH_PROGRAM, start);
+  xSemaphoreGive(flashLock);
 }
 
 void flash_read(uint32_t addr, uint8_t * out_data, unsigned int len) {
-  pi_flash_read(&flash_dev, addr, out_data, len);
+  lock_flash();
+  if (len <= CACHE_READ_MAX) {
+    cache_read(addr, out_data, len);
+  } else {
+    read_locked(addr, out_data, len);
+  }
+  xSemaphoreGive(flashLock);
 }
 
 void flash_erase_sector(uint32_t addr) {
-  pi_flash_erase_sector(&flash_dev, addr);
-}
\ No newline at end of file
+  uint32_t sectorStart;
+  uint32_t sectorSize;
+  flash_sector(addr, &sectorStart, &sectorSize);
+
+  pi_task_t done;
+
+  lock_flash();
+  cache_invalidate(sectorStart, sectorSize);
+  uint32_t start = stats_now();
+  pi_flash_erase_sector_async(&flash_dev, addr, pi_task_block(&done));
+  xSemaphoreGive(flashLock);
+
+  // The driver polls the status of the erase and holds back what else is
+  // issued to the flash until it's done, so the lock isn't kept meanwhile.
+  // Reads and programs still wait for the erase, but in the driver.
+  pi_task_wait_on(&done);
+  stats_add(STATS_FLASH_ERASE, start);
+}
+
+static void submit(flash_request_t * request, flash_op_t op, uint32_t addr, uint8_t * data, unsigned int len) {
+  request->op = op;
+  request->addr = addr;
+  request->data = data;
+  request->len = len;
+  request->owner = xTaskGetCurrentTaskHandle();
+  request->completed = false;
+  xQueueSend(requestQueue, &request, portMAX_DELAY);
+}
+
+void flash_read_submit(flash_request_t * request, uint32_t addr, uint8_t * out_data, unsigned int len) {
+  submit(request, FLASH_OP_READ, addr, out_data, len);
+}
+
+// Each completed request gives its owner one notification. They are taken one
+// at a time instead of clearing the count, and the completed flag tells which
+// request is done, so other requests of the task completing meanwhile don't
+// make their own waits miss anything. A request completed before it's waited
+// for leaves its notification, a later wait then only checks its flag once
+// more.
+void flash_request_wait(flash_request_t * request) {
+  while (!request->completed) {
+    ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+  }
+}
+
+void flash_erase(uint32_t addr, uint32_t size) {
+  uint32_t sectorStart;
+  uint32_t sectorSize;
+
+  while (size > 0) {
+    flash_sector(addr, &sectorStart, &sectorSize);
+    if (sectorStart == addr) {
+      flash_erase_sector(addr);
+    }
+
+    uint32_t next = sectorStart + sectorSize;
+    size = next - addr < size ? size - (next - addr) : 0;
+    addr = next;
+  }
+}
+
+// Wait for the program of a buffer, if it's in flight
+static void combine_reap(int buffer) {
+  if (combinePending[buffer]) {
+    flash_request_t * request = &combineRequests[buffer];
+    flash_request_wait(request);
+    combinePending[buffer] = false;
+
+    if (combineProgrammed != NULL) {
+      combineProgrammed(request->addr, request->data, request->len);
+    }
+  }
+}
+
+void flash_combine_wait(void) {
+  combine_reap(1 - combineCurrent);
+}
+
+// Continue collecting at addr, nothing may be left to program
+static void combine_restart(uint32_t addr) {
+  combineWindow = addr / FLASH_BUFFER_SIZE * FLASH_BUFFER_SIZE;
+  combineStart = addr;
+  combineEnd = addr;
+}
+
+// Submit what has been collected in the current buffer and continue in the
+// other one, once its previous program is done
+static void combine_program(void) {
+  uint32_t size = combineEnd - combineStart;
+  if (size == 0) {
+    return;
+  }
+
+  submit(&combineRequests[combineCurrent], FLASH_OP_PROGRAM, combineStart,
+         &combineBuffers[combineCurrent][combineStart - combineWindow], size);
+  combinePending[combineCurrent] = true;
+
+  combineCurrent = 1 - combineCurrent;
+  combine_reap(combineCurrent);
+  combine_restart(combineEnd);
+}
+
+void flash_combine_start(void (*programmed)(uint32_t addr, const uint8_t * data, uint32_t len)) {
+  flash_combine_flush();
+  combineProgrammed = programmed;
+  combine_restart(0);
+}
+
+void flash_combine_write(uint32_t addr, const uint8_t * data, uint32_t len) {
+  if (addr != combineEnd) {
+    combine_program();
+    combine_restart(addr);
+  }
+
+  while (len > 0) {
+    uint32_t space = combineWindow + COMBINE_SIZE - combineEnd;
+    uint32_t size = len < space ? len : space;
+
+    memcpy(&combineBuffers[combineCurrent][combineEnd - combineWindow], data, size);
+    combineEnd += size;
+    data += size;
+    len -= size;
+
+    if (combineEnd == combineWindow + COMBINE_SIZE) {
+      combine_program();
+    }
+  }
+}
+
+void flash_combine_flush(void) {
+  combine_program();
+  flash_combine_wait();
+}
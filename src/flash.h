@@ -25,20 +25,88 @@
  * flash.h - Interface for Hyperflash
  */
 
+#include "pmsis.h"
+
 #include "com.h"
 
 #ifndef __FLASH_H__
 #define __FLASH_H__
 
-// TODO: Set this size exactly
-#define FLASH_BUFFER_SIZE (64)
+// Size of the HyperFlash write buffer, an aligned buffer of this size is
+// programmed in one operation
+#define FLASH_BUFFER_SIZE (512)
+
+#define PAGE_SIZE (0x40000)
+
+// The AI-deck has a 64 MiB HyperFlash, the last two sectors are reserved for
+// the bootloader metadata (see meta.c). The application image, including its
+// partitions and file systems, must end before them.
+#define FLASH_SIZE (0x4000000)
+#define META_SECTORS (2)
+#define META_ADDRESS (FLASH_SIZE - META_SECTORS * PAGE_SIZE)
 
 void flash_init(void);
 
+// Erase sector size reported by the flash
+uint32_t flash_sector_size(void);
+
+// Start and size of the erase sector containing addr, the sectors are all the
+// size reported by the flash
+void flash_sector(uint32_t addr, uint32_t * start, uint32_t * size);
+
 void flash_write(uint32_t addr, uint8_t * in_data, unsigned int len);
 
+// Small reads are served from a cache of recently read flash, which is kept
+// coherent with the programs and erases done through this interface
 void flash_read(uint32_t addr, uint8_t * out_data, unsigned int len);
 
 void flash_erase_sector(uint32_t addr);
 
+typedef enum {
+  FLASH_OP_READ,
+  FLASH_OP_PROGRAM, // Only submitted by the write combining
+} flash_op_t;
+
+// An operation queued for the flash task
+typedef struct {
+  flash_op_t op;
+  uint32_t addr;
+  uint8_t * data;
+  uint32_t len;
+  TaskHandle_t owner;
+  volatile bool completed;
+} flash_request_t;
+
+// Number of requests that can be queued before submitting blocks
+#define FLASH_QUEUE_LENGTH (4)
+
+// Queue a read and return without waiting for it. Requests are run by the
+// flash task in the order they are submitted, each one takes the flash lock
+// only while it runs. When a request is completed the submitting task gets a
+// task notification. The request and out_data must be kept until then.
+void flash_read_submit(flash_request_t * request, uint32_t addr, uint8_t * out_data, unsigned int len);
+
+// Wait for a submitted request to be completed, the task's notification count
+// is only decremented so other pending notifications are kept
+void flash_request_wait(flash_request_t * request);
+
+// Writes are collected into whole, aligned write buffers, so chunks of any
+// size and alignment only cost one program operation per buffer. Full buffers
+// are submitted to the flash task while more data is collected, the flash is
+// not held while they wait. Each completed program is passed to programmed,
+// which may use the flash, if it's not NULL.
+void flash_combine_start(void (*programmed)(uint32_t addr, const uint8_t * data, uint32_t len));
+
+// Collect len bytes for addr, data can be reused as soon as this returns
+void flash_combine_write(uint32_t addr, const uint8_t * data, uint32_t len);
+
+// Wait for the programs in flight and pass them to programmed
+void flash_combine_wait(void);
+
+// Program everything collected so far and wait for it
+void flash_combine_flush(void);
+
+// Erase all sectors starting inside [addr, addr + size)
+void flash_erase(uint32_t addr, uint32_t size);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,155 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * lz.c - Streaming decoder for LZ compressed images
+ *
+ * The output is decoded into a ring buffer that is also the history used for
+ * matches. Each half is handed to the output callback as soon as it is full,
+ * so it can be programmed while the other half is being filled.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lz.h"
+
+typedef enum {
+  LZ_TOKEN = 0,
+  LZ_LITERALS_EXT,
+  LZ_LITERALS,
+  LZ_OFFSET_LO,
+  LZ_OFFSET_HI,
+  LZ_MATCH_EXT
+} lz_state_t;
+
+void lz_init(lz_decoder_t * lz, uint8_t * window, uint32_t windowSize, uint32_t outputSize, lz_output_cb_t output) {
+  lz->state = LZ_TOKEN;
+  lz->matchNibble = 0;
+  lz->offset = 0;
+  lz->literals = 0;
+  lz->match = 0;
+
+  lz->window = window;
+  lz->windowSize = windowSize;
+  lz->pos = 0;
+  lz->flushed = 0;
+  lz->produced = 0;
+  lz->outputLeft = outputSize;
+  lz->output = output;
+}
+
+static bool put(lz_decoder_t * lz, uint8_t b) {
+  if (lz->outputLeft == 0) {
+    return false;
+  }
+
+  lz->window[lz->pos] = b;
+  lz->pos = (lz->pos + 1) & (lz->windowSize - 1);
+  lz->produced++;
+  lz->outputLeft--;
+
+  if (lz->pos % (lz->windowSize / 2) == 0 || lz->outputLeft == 0) {
+    uint32_t end = lz->pos == 0 ? lz->windowSize : lz->pos;
+    lz->output(&lz->window[lz->flushed], end - lz->flushed);
+    lz->flushed = lz->pos;
+  }
+
+  return true;
+}
+
+static bool copy_match(lz_decoder_t * lz) {
+  // Anything further back than half the window might already be overwritten
+  if (lz->offset == 0 || lz->offset > lz->windowSize / 2 || lz->offset > lz->produced) {
+    return false;
+  }
+
+  while (lz->match > 0) {
+    uint32_t src = (lz->pos - lz->offset) & (lz->windowSize - 1);
+    if (!put(lz, lz->window[src])) {
+      return false;
+    }
+    lz->match--;
+  }
+
+  lz->state = LZ_TOKEN;
+  return true;
+}
+
+int lz_decode(lz_decoder_t * lz, const uint8_t * in, uint32_t size) {
+  for (uint32_t i = 0; i < size; i++) {
+    uint8_t b = in[i];
+
+    switch (lz->state) {
+      case LZ_TOKEN:
+        lz->literals = b >> 4;
+        lz->matchNibble = b & 0x0F;
+        lz->match = lz->matchNibble + LZ_MIN_MATCH;
+        if (lz->literals == 15) {
+          lz->state = LZ_LITERALS_EXT;
+        } else if (lz->literals > 0) {
+          lz->state = LZ_LITERALS;
+        } else {
+          lz->state = LZ_OFFSET_LO;
+        }
+        break;
+      case LZ_LITERALS_EXT:
+        lz->literals += b;
+        if (b != 255) {
+          lz->state = LZ_LITERALS;
+        }
+        break;
+      case LZ_LITERALS:
+        if (!put(lz, b)) {
+          return -1;
+        }
+        lz->literals--;
+        if (lz->literals == 0) {
+          lz->state = LZ_OFFSET_LO;
+        }
+        break;
+      case LZ_OFFSET_LO:
+        lz->offset = b;
+        lz->state = LZ_OFFSET_HI;
+        break;
+      case LZ_OFFSET_HI:
+        lz->offset |= (uint16_t) b << 8;
+        if (lz->matchNibble == 15) {
+          lz->state = LZ_MATCH_EXT;
+        } else if (!copy_match(lz)) {
+          return -1;
+        }
+        break;
+      case LZ_MATCH_EXT:
+        lz->match += b;
+        if (b != 255 && !copy_match(lz)) {
+          return -1;
+        }
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,68 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * lz.h - Streaming decoder for LZ compressed images
+ */
+
+#include <stdint.h>
+
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// The stream is a list of LZ4 style sequences:
+//
+//   token, [literal length bytes], literals, offset (LE16), [match length bytes]
+//
+// The high nibble of the token is the literal length and the low nibble is the
+// match length minus LZ_MIN_MATCH, 15 means that more length bytes follow
+// (added until a byte that isn't 255). The last sequence can stop after the
+// literals, the stream ends when all output has been produced. Offsets can be
+// at most half the window size.
+#define LZ_MIN_MATCH (4)
+
+// Called with each filled half of the window, and the last part of the output
+typedef void (*lz_output_cb_t)(uint8_t * data, uint32_t size);
+
+typedef struct {
+  uint8_t state;
+  uint8_t matchNibble;
+  uint16_t offset;
+  uint32_t literals;
+  uint32_t match;
+
+  uint8_t * window;
+  uint32_t windowSize; // Power of 2
+  uint32_t pos;
+  uint32_t flushed;
+  uint32_t produced;
+  uint32_t outputLeft;
+  lz_output_cb_t output;
+} lz_decoder_t;
+
+void lz_init(lz_decoder_t * lz, uint8_t * window, uint32_t windowSize, uint32_t outputSize, lz_output_cb_t output);
+
+// Decode size bytes of the stream, returns -1 if the stream is corrupt
+int lz_decode(lz_decoder_t * lz, const uint8_t * in, uint32_t size);
+
+#endif
\ No newline at end of file
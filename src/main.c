@@ -34,6 +34,9 @@
 #include "cpx.h"
 #include "bl.h"
 #include "flash.h"
+#include "meta.h"
+#include "stats.h"
+#include "trace.h"
 
 #if 0
 #define DEBUG_PRINTF printf
@@ -43,6 +46,11 @@
 
 #define LED_PIN 2
 
+// The deepest calls are a verified write, which runs SHA-256 blocks from
+// the flash combining callback, and booting, both below the command
+// handling and its printf. Check the use with the bl stack counter.
+#define BL_STACK_DEPTH (configMINIMAL_STACK_SIZE * 4)
+
 static pi_device_t led_gpio_dev;
 
 void hb_task( void *parameters )
@@ -63,67 +71,150 @@ void hb_task( void *parameters )
     }
 }
 
-// These must be in L2 for uDMA to work
-static CPXPacket_t txp;
-static CPXPacket_t rxp;
-
 extern void pi_bsp_init(void);
 
 void bl_task( void *parameters )
 {
-  uint8_t len;
-  uint8_t count;
-
-  vTaskDelay(1000);
+  CPXPacket_t * rxp;
+  uint32_t size;
+
+  // Until a host has talked to the bootloader the application is booted once
+  // the configured time has passed since reset, if the image is valid. Packets
+  // that aren't for the bootloader don't postpone it.
+  uint32_t hostWait = bl_autoBootWait();
+  TickType_t waitStart = xTaskGetTickCount();
+  bool hostSeen = false;
+
+  if (hostWait == BL_HOST_WAIT_FOREVER) {
+    vTaskDelay(1000);
+  }
 
   while (1) {
-    uint32_t size = cpxReceivePacketBlocking(&rxp);
-    
-    DEBUG_PRINTF(">> 0x%02X->0x%02X (0x%02X) (size=%u)\n", rxp.route.source, rxp.route.destination, rxp.route.function, size);
-    if (rxp.route.function == BOOTLOADER) {
-      BLPacket_t * blpRx = (BLPacket_t*) rxp.data;
-      BLPacket_t * blpTx = (BLPacket_t*) txp.data;
+    if (hostSeen || hostWait == BL_HOST_WAIT_FOREVER) {
+      size = cpxReceivePacketBlocking(&rxp);
+    } else {
+      uint32_t waited = (xTaskGetTickCount() - waitStart) * portTICK_PERIOD_MS;
+      size = cpxReceivePacketTimeout(&rxp, waited < hostWait ? hostWait - waited : 0);
+      if (rxp == NULL) {
+        DEBUG_PRINTF("No host within %u ms, booting\n", hostWait);
+        bl_boot_to_application();
+        // Only returns if the image can't be booted
+        hostSeen = true;
+        continue;
+      }
+    }
+
+    DEBUG_PRINTF(">> 0x%02X->0x%02X (0x%02X) (size=%u)\n", rxp->route.source, rxp->route.destination, rxp->route.function, size);
+    if (rxp->route.function == BOOTLOADER) {
+      // Fields added at the end of commands are 0 when not sent by older hosts
+      memset(&rxp->data[size], 0, sizeof(rxp->data) - size);
+
+      BLPacket_t * blpRx = (BLPacket_t*) rxp->data;
+      CPXPacket_t * txp = NULL;
+
+      hostSeen = true;
 
       DEBUG_PRINTF("Received command [0x%02X] for bootloader\n", blpRx->cmd);
 
       uint16_t replySize = 0;
+      uint32_t commandStart = stats_now();
+      trace_log(TRACE_CMD_START, blpRx->cmd, 0);
 
       // Fix the header of the outgoing answer
-      txp.route.source = GAP8;
-      txp.route.destination = rxp.route.source;
-      txp.route.function = BOOTLOADER;
+      CPXRouting_t route = {
+        .destination = rxp->route.source,
+        .source = GAP8,
+        .function = BOOTLOADER
+      };
 
       switch(blpRx->cmd) {
         case BL_CMD_VERSION:
-          replySize = bl_handleVersionCommand((VersionOut_t*) blpTx->data);
+          txp = bl_allocReply(&route);
+          replySize = bl_handleVersionCommand((VersionOut_t*) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_INFO:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleInfoCommand((InfoOut_t*) ((BLPacket_t*) txp->data)->data);
           break;
         case BL_CMD_READ:
-          bl_handleReadCommand( (ReadIn_t*) blpRx->data, &txp);
+          bl_handleReadCommand( (ReadIn_t*) blpRx->data, &route);
           break;
         case BL_CMD_WRITE:
-          bl_handleWriteCommand( (ReadIn_t*) blpRx->data, &rxp, &txp);
+          bl_handleWriteCommand( (ReadIn_t*) blpRx->data);
           break;          
+        case BL_CMD_WRITE_WINDOWED:
+          bl_handleWriteWindowedCommand( (WriteWindowedIn_t*) blpRx->data, &route);
+          break;
         case BL_CMD_MD5:
-          replySize = bl_handleMD5Command((ReadIn_t*) blpRx->data, (MD5Out_t *) blpTx->data);
+          txp = bl_allocReply(&route);
+          replySize = bl_handleMD5Command((ReadIn_t*) blpRx->data, (MD5Out_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_DIGEST:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleDigestCommand((DigestIn_t*) blpRx->data, (DigestOut_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_HASHMAP:
+          bl_handleHashMapCommand((HashMapIn_t*) blpRx->data, &route);
+          break;
+        case BL_CMD_ERASEPAGE:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleEraseCommand((ReadIn_t*) blpRx->data, (EraseOut_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_JOURNAL:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleJournalCommand((BLWriteJournal_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_BOOT_CONFIG:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleBootConfigCommand((BootConfigIn_t*) blpRx->data, (BLBootConfig_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_IMAGE:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleImageCommand((ImageIn_t*) blpRx->data, (BLImageDescriptor_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_STATS:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleStatsCommand((StatsIn_t*) blpRx->data, (StatsOut_t *) ((BLPacket_t*) txp->data)->data);
+          break;
+        case BL_CMD_TRACE:
+          bl_handleTraceCommand((TraceIn_t*) blpRx->data, &route);
+          break;
+        case BL_CMD_BATCH:
+          txp = bl_allocReply(&route);
+          replySize = bl_handleBatchCommand((BatchIn_t*) blpRx->data, (BatchOut_t *) ((BLPacket_t*) txp->data)->data);
           break;
         case BL_CMD_JMP:
           bl_boot_to_application();
           break;  
+        case BL_CMD_WRITE_DATA:
+          DEBUG_PRINTF("Dropping chunk of a write that has ended\n");
+          break;
         default:
           printf("Not handling bootloader command [0x%02X]\n", blpRx->cmd);
       }
 
       if (replySize > 0) {
+        BLPacket_t * blpTx = (BLPacket_t*) txp->data;
+
         // Include command header byte
         blpTx->cmd = blpRx->cmd;
         replySize += sizeof(BLCommand_t);
 
         DEBUG_PRINTF("Sending back reply of %u bytes\n", replySize);
 
-        cpxSendPacketBlocking(&txp, replySize);
+        cpxSendPacketBlocking(txp, replySize);
+      } else if (txp != NULL) {
+        cpxFreePacket(txp);
+      }
+
+      trace_log(TRACE_CMD_END, blpRx->cmd, 0);
+      if (blpRx->cmd < STATS_COMMANDS) {
+        stats_add(STATS_COMMAND + blpRx->cmd, commandStart);
       }
       
     }
+
+    cpxFreePacket(rxp);
   }
 }
 
@@ -143,6 +234,8 @@ void start_bootloader(void)
     printf("\n-- GAP8 bootloader --\n");
 
     flash_init();
+    bl_init();
+    meta_init();
 
     BaseType_t xTask;
 
@@ -156,13 +249,15 @@ void start_bootloader(void)
 
     com_init();
 
-    xTask = xTaskCreate( bl_task, "bootloader task", configMINIMAL_STACK_SIZE * 3,
-                         NULL, tskIDLE_PRIORITY + 1, NULL );
+    TaskHandle_t task;
+    xTask = xTaskCreate( bl_task, "bootloader task", BL_STACK_DEPTH,
+                         NULL, tskIDLE_PRIORITY + 1, &task );
     if( xTask != pdPASS )
     {
         printf("Bootloader task did not start !\n");
         pmsis_exit(-1);
     }
+    stats_task(STATS_STACK_BL, task, BL_STACK_DEPTH);
 
     while(1)
     {
@@ -0,0 +1,310 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * meta.c - Bootloader metadata records in flash
+ *
+ * The records are appended to a log in one of the two last sectors of the
+ * flash, so a record can be updated without erasing. The latest record of each
+ * type is the valid one. When the sector is full the latest records are
+ * written to the other sector, which only takes over when its header is
+ * written after them, so a reset while compacting never loses the records.
+ *
+ * Each time the log passes a multiple of META_CHECKPOINT_INTERVAL, where the
+ * latest records are is stored at the start of the sector. At boot the log is
+ * only scanned from the last checkpoint.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "pmsis.h"
+
+#include "flash.h"
+#include "crc32.h"
+#include "meta.h"
+
+#if 0
+#define DEBUG_PRINTF printf
+#else
+#define DEBUG_PRINTF(...) ((void) 0)
+#endif /* DEBUG */
+
+#define META_MAGIC (0xB1EC)
+#define META_ERASED (0xFFFF)
+#define META_SECTOR_MAGIC (0xB1EC5EC7)
+
+typedef struct {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t size;
+  uint32_t crc; // Of type, size and payload
+} __attribute__((__packed__)) meta_header_t;
+
+// Written at the start of a sector once the log has been moved to it
+typedef struct {
+  uint32_t magic;
+  uint32_t generation; // The sector with the highest one has the log
+  uint32_t crc; // Of generation
+} __attribute__((__packed__)) meta_sector_t;
+
+// Offsets are in units of META_ALIGN
+typedef struct {
+  uint16_t end; // Where the log continues
+  uint16_t latest[META_TYPE_COUNT]; // META_CHECKPOINT_NONE if there is none
+  uint16_t check; // Low half of the CRC32 of the rest
+} __attribute__((__packed__)) meta_checkpoint_t;
+
+// Records are padded so they always start aligned
+#define META_ALIGN (4)
+#define META_RECORD_SPACE(size) ((sizeof(meta_header_t) + (size) + META_ALIGN - 1) & ~(META_ALIGN - 1))
+
+// Checkpoint n is written when the log passes n intervals, 0 is never used
+#define META_CHECKPOINT_INTERVAL (4096)
+#define META_CHECKPOINTS (PAGE_SIZE / META_CHECKPOINT_INTERVAL)
+#define META_CHECKPOINT_NONE (0xFFFF)
+
+#define META_LOG_START ((sizeof(meta_sector_t) + META_CHECKPOINTS * sizeof(meta_checkpoint_t) + META_ALIGN - 1) & ~(META_ALIGN - 1))
+
+#define META_NONE (0xFFFFFFFF)
+
+// Sector with the log, META_NONE if none has been written yet
+static uint32_t activeSector;
+static uint32_t generation;
+// Where the log is being written, the active sector except while compacting
+static uint32_t logAddress;
+
+// Offset in the sector of the latest record of each type
+static uint32_t latest[META_TYPE_COUNT];
+// Where the next record is written
+static uint32_t writeOffset;
+
+static PI_L2 uint8_t recordBuffer[sizeof(meta_header_t) + META_RECORD_MAX];
+static PI_L2 meta_checkpoint_t checkpoints[META_CHECKPOINTS];
+
+static uint32_t sector_address(uint32_t sector) {
+  return META_ADDRESS + sector * PAGE_SIZE;
+}
+
+static uint32_t record_crc(const meta_header_t * header, const uint8_t * payload) {
+  uint32_t crc = crc32_update(0, &header->type, sizeof(header->type) + sizeof(header->size));
+  return crc32_update(crc, payload, header->size);
+}
+
+static uint16_t checkpoint_check(const meta_checkpoint_t * checkpoint) {
+  return crc32_update(0, (const uint8_t *) checkpoint, offsetof(meta_checkpoint_t, check)) & 0xFFFF;
+}
+
+// Read the record at offset into recordBuffer, false if it's not intact
+static bool read_record(uint32_t offset) {
+  meta_header_t * header = (meta_header_t *) recordBuffer;
+
+  flash_read(logAddress + offset, recordBuffer, sizeof(meta_header_t));
+  if (header->magic != META_MAGIC || header->size > META_RECORD_MAX ||
+      offset + META_RECORD_SPACE(header->size) > PAGE_SIZE) {
+    return false;
+  }
+
+  flash_read(logAddress + offset + sizeof(meta_header_t), &recordBuffer[sizeof(meta_header_t)], header->size);
+  return header->crc == record_crc(header, &recordBuffer[sizeof(meta_header_t)]);
+}
+
+// Returns false if the sector has no intact header
+static bool read_sector(uint32_t sector, uint32_t * sectorGeneration) {
+  meta_sector_t header;
+
+  flash_read(sector_address(sector), (uint8_t *) &header, sizeof(header));
+  *sectorGeneration = header.generation;
+  return header.magic == META_SECTOR_MAGIC &&
+         header.crc == crc32_update(0, (uint8_t *) &header.generation, sizeof(header.generation));
+}
+
+// Continue from the last intact checkpoint, or from the start of the log
+static void load_checkpoint(void) {
+  writeOffset = META_LOG_START;
+
+  flash_read(logAddress + sizeof(meta_sector_t), (uint8_t *) checkpoints, sizeof(checkpoints));
+  for (int i = META_CHECKPOINTS - 1; i > 0; i--) {
+    const meta_checkpoint_t * checkpoint = &checkpoints[i];
+    if (checkpoint->end == META_CHECKPOINT_NONE || checkpoint->check != checkpoint_check(checkpoint)) {
+      continue;
+    }
+
+    writeOffset = checkpoint->end * META_ALIGN;
+    for (int type = 0; type < META_TYPE_COUNT; type++) {
+      if (checkpoint->latest[type] != META_CHECKPOINT_NONE) {
+        latest[type] = checkpoint->latest[type] * META_ALIGN;
+      }
+    }
+    DEBUG_PRINTF("Metadata log continues from checkpoint %u\n", i);
+    break;
+  }
+}
+
+void meta_init(void) {
+  meta_header_t header;
+  uint32_t offset;
+  uint32_t sectorGeneration;
+
+  activeSector = META_NONE;
+  for (int i = 0; i < META_TYPE_COUNT; i++) {
+    latest[i] = META_NONE;
+  }
+
+  for (uint32_t sector = 0; sector < META_SECTORS; sector++) {
+    if (read_sector(sector, &sectorGeneration) &&
+        (activeSector == META_NONE || (int32_t) (sectorGeneration - generation) > 0)) {
+      activeSector = sector;
+      generation = sectorGeneration;
+    }
+  }
+
+  if (activeSector == META_NONE) {
+    DEBUG_PRINTF("No metadata log\n");
+    return;
+  }
+
+  logAddress = sector_address(activeSector);
+  load_checkpoint();
+  offset = writeOffset;
+
+  while (offset + sizeof(meta_header_t) <= PAGE_SIZE) {
+    flash_read(logAddress + offset, (uint8_t *) &header, sizeof(header));
+
+    if (header.magic == META_ERASED) {
+      break;
+    }
+
+    if (header.magic != META_MAGIC || header.size > META_RECORD_MAX ||
+        offset + META_RECORD_SPACE(header.size) > PAGE_SIZE) {
+      // A record that was interrupted while written, the size can't be
+      // trusted so nothing more can be appended until the log is compacted
+      DEBUG_PRINTF("Broken record @ 0x%X\n", offset);
+      offset = PAGE_SIZE;
+      break;
+    }
+
+    if (header.type < META_TYPE_COUNT && read_record(offset)) {
+      latest[header.type] = offset;
+    }
+
+    offset += META_RECORD_SPACE(header.size);
+  }
+
+  writeOffset = offset;
+  DEBUG_PRINTF("Metadata log is %u bytes in sector %u\n", writeOffset, activeSector);
+}
+
+bool meta_read(meta_type_t type, void * data, uint32_t size) {
+  meta_header_t * header = (meta_header_t *) recordBuffer;
+
+  if (latest[type] == META_NONE || !read_record(latest[type]) || header->size != size) {
+    return false;
+  }
+
+  memcpy(data, &recordBuffer[sizeof(meta_header_t)], size);
+  return true;
+}
+
+static void write_checkpoint(uint32_t index) {
+  meta_checkpoint_t * checkpoint = &checkpoints[index];
+
+  checkpoint->end = writeOffset / META_ALIGN;
+  for (int type = 0; type < META_TYPE_COUNT; type++) {
+    checkpoint->latest[type] = latest[type] == META_NONE ? META_CHECKPOINT_NONE : latest[type] / META_ALIGN;
+  }
+  checkpoint->check = checkpoint_check(checkpoint);
+
+  flash_write(logAddress + sizeof(meta_sector_t) + index * sizeof(meta_checkpoint_t),
+              (uint8_t *) checkpoint, sizeof(meta_checkpoint_t));
+}
+
+static void append_record(meta_type_t type, const void * data, uint32_t size) {
+  meta_header_t * header = (meta_header_t *) recordBuffer;
+  uint32_t interval = writeOffset / META_CHECKPOINT_INTERVAL;
+
+  memset(recordBuffer, 0xFF, sizeof(recordBuffer));
+  header->magic = META_MAGIC;
+  header->type = type;
+  header->size = size;
+  memcpy(&recordBuffer[sizeof(meta_header_t)], data, size);
+  header->crc = record_crc(header, &recordBuffer[sizeof(meta_header_t)]);
+
+  flash_write(logAddress + writeOffset, recordBuffer, META_RECORD_SPACE(size));
+  latest[type] = writeOffset;
+  writeOffset += META_RECORD_SPACE(size);
+
+  if (writeOffset / META_CHECKPOINT_INTERVAL > interval && writeOffset < PAGE_SIZE) {
+    write_checkpoint(writeOffset / META_CHECKPOINT_INTERVAL);
+  }
+}
+
+// Move the latest records to the other sector. The log stays in the old
+// sector until the header of the new one is written after the records.
+static void compact(void) {
+  static uint8_t saved[META_TYPE_COUNT][META_RECORD_MAX];
+  static uint8_t savedSize[META_TYPE_COUNT];
+  meta_header_t * header = (meta_header_t *) recordBuffer;
+  uint32_t next = activeSector == META_NONE ? 0 : (activeSector + 1) % META_SECTORS;
+
+  for (int i = 0; i < META_TYPE_COUNT; i++) {
+    savedSize[i] = 0;
+    if (latest[i] != META_NONE && read_record(latest[i])) {
+      savedSize[i] = header->size;
+      memcpy(saved[i], &recordBuffer[sizeof(meta_header_t)], header->size);
+    }
+    latest[i] = META_NONE;
+  }
+
+  DEBUG_PRINTF("Compacting metadata log to sector %u\n", next);
+  flash_erase(sector_address(next), PAGE_SIZE);
+  logAddress = sector_address(next);
+  writeOffset = META_LOG_START;
+
+  for (int i = 0; i < META_TYPE_COUNT; i++) {
+    if (savedSize[i] > 0) {
+      append_record(i, saved[i], savedSize[i]);
+    }
+  }
+
+  meta_sector_t * sector = (meta_sector_t *) recordBuffer;
+  sector->magic = META_SECTOR_MAGIC;
+  sector->generation = activeSector == META_NONE ? 1 : generation + 1;
+  sector->crc = crc32_update(0, (uint8_t *) &sector->generation, sizeof(sector->generation));
+  flash_write(logAddress, recordBuffer, sizeof(meta_sector_t));
+
+  activeSector = next;
+  generation = sector->generation;
+}
+
+void meta_write(meta_type_t type, const void * data, uint32_t size) {
+  if (size > META_RECORD_MAX) {
+    return;
+  }
+
+  if (activeSector == META_NONE || writeOffset + META_RECORD_SPACE(size) > PAGE_SIZE) {
+    compact();
+  }
+
+  append_record(type, data, size);
+}
@@ -0,0 +1,54 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * meta.h - Bootloader metadata records in flash
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef __META_H__
+#define __META_H__
+
+// Max payload of a record
+#define META_RECORD_MAX (128)
+
+typedef enum {
+  META_TYPE_BOOT_CONFIG = 0,
+  META_TYPE_IMAGE = 1,
+  META_TYPE_JOURNAL = 2,
+  META_TYPE_COUNT
+} meta_type_t;
+
+// Find the latest records, must be called after flash_init
+void meta_init(void);
+
+// Copy the latest record of type into data, returns false if there is none or
+// if it's not size bytes
+bool meta_read(meta_type_t type, void * data, uint32_t size);
+
+// Store a new record of type, replacing the earlier one
+void meta_write(meta_type_t type, const void * data, uint32_t size);
+
+#endif
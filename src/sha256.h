@@ -0,0 +1,48 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * sha256.h - SHA-256 (FIPS 180-4)
+ */
+
+#include <stdint.h>
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#define SHA256_DIGEST_SIZE (32)
+
+typedef struct {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+  uint32_t blockSize;
+} sha256_ctx_t;
+
+void sha256_init(sha256_ctx_t * ctx);
+
+void sha256_update(sha256_ctx_t * ctx, const uint8_t * data, uint32_t size);
+
+void sha256_final(sha256_ctx_t * ctx, uint8_t * digest);
+
+#endif
\ No newline at end of file
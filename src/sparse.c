@@ -0,0 +1,69 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * sparse.c - Runs of the chunks of a sparse write
+ *
+ * The host sends runs of erased or zero bytes in a sparse write as only their
+ * type and size, the rest as data. Each chunk is a list of runs that is
+ * checked one run at a time, before it's passed on.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sparse.h"
+
+int32_t sparse_parse(const uint8_t * chunk, uint32_t size, uint32_t left, sparse_run_cb_t run) {
+  uint32_t offset = 0;
+  uint32_t described = 0;
+
+  while (offset < size) {
+    const SparseRun_t * r = (const SparseRun_t *) &chunk[offset];
+
+    if (size - offset < sizeof(SparseRun_t) || r->size > left - described) {
+      return -1;
+    }
+    offset += sizeof(SparseRun_t);
+
+    switch (r->type) {
+      case BL_SPARSE_DATA:
+        if (r->size > size - offset) {
+          return -1;
+        }
+        run(r->type, r->data, r->size);
+        offset += r->size;
+        break;
+      case BL_SPARSE_ERASED:
+      case BL_SPARSE_ZERO:
+        run(r->type, NULL, r->size);
+        break;
+      default:
+        return -1;
+    }
+
+    described += r->size;
+  }
+
+  return described;
+}
@@ -0,0 +1,54 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * sparse.h - Runs of the chunks of a sparse write
+ */
+
+#include <stdint.h>
+
+#ifndef __SPARSE_H__
+#define __SPARSE_H__
+
+typedef enum {
+  BL_SPARSE_DATA = 0,   // Followed by size bytes of data
+  BL_SPARSE_ERASED = 1, // size bytes of BL_BYTE, left as erased
+  BL_SPARSE_ZERO = 2    // size bytes of 0
+} __attribute__((__packed__)) BLSparseRun_t;
+
+// Run of a write with BL_WRITE_FLAG_SPARSE, runs never span chunks
+typedef struct {
+  BLSparseRun_t type;
+  uint32_t size;
+  uint8_t data[];
+} __attribute__((__packed__)) SparseRun_t;
+
+// Called with each run of a chunk, data is only set for BL_SPARSE_DATA
+typedef void (*sparse_run_cb_t)(BLSparseRun_t type, const uint8_t * data, uint32_t size);
+
+// Pass the runs of one chunk to run, returns the size of the data they
+// describe or -1 if the chunk is malformed or describes more than left bytes.
+// Nothing after a malformed run is passed on.
+int32_t sparse_parse(const uint8_t * chunk, uint32_t size, uint32_t left, sparse_run_cb_t run);
+
+#endif
@@ -0,0 +1,94 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * stats.c - Performance counters of the bootloader
+ *
+ * The counters are updated from several tasks, so they're only touched with
+ * interrupts disabled. Timing uses the microsecond timer rather than printing,
+ * so it doesn't change the timing it measures.
+ */
+
+#include <string.h>
+
+#include "pmsis.h"
+
+#include "stats.h"
+
+static stats_entry_t counters[STATS_COUNT];
+
+// Tasks reported in the stack counters, from STATS_STACK_BL
+#define STATS_STACKS (STATS_COUNT - STATS_STACK_BL)
+static TaskHandle_t tasks[STATS_STACKS];
+
+uint32_t stats_now(void) {
+  return pi_time_get_us();
+}
+
+void stats_add(stats_counter_t counter, uint32_t start) {
+  uint32_t duration = stats_now() - start;
+
+  if (counter >= STATS_COUNT) {
+    return;
+  }
+
+  taskENTER_CRITICAL();
+  counters[counter].count++;
+  counters[counter].total += duration;
+  if (duration > counters[counter].max) {
+    counters[counter].max = duration;
+  }
+  taskEXIT_CRITICAL();
+}
+
+void stats_count(stats_counter_t counter) {
+  stats_add(counter, stats_now());
+}
+
+void stats_task(stats_counter_t counter, TaskHandle_t task, uint32_t stackDepth) {
+  if (counter < STATS_STACK_BL || counter >= STATS_COUNT) {
+    return;
+  }
+
+  tasks[counter - STATS_STACK_BL] = task;
+  counters[counter].count = stackDepth * sizeof(StackType_t);
+}
+
+void stats_get(stats_entry_t * entries, bool reset) {
+  taskENTER_CRITICAL();
+  memcpy(entries, counters, sizeof(counters));
+  if (reset) {
+    memset(counters, 0, sizeof(counters));
+    // Keep the stack sizes
+    memcpy(&counters[STATS_STACK_BL], &entries[STATS_STACK_BL], STATS_STACKS * sizeof(stats_entry_t));
+  }
+  taskEXIT_CRITICAL();
+
+  // The high water mark is the least stack that has been left, in words
+  for (int i = 0; i < STATS_STACKS; i++) {
+    stats_entry_t * entry = &entries[STATS_STACK_BL + i];
+    if (tasks[i] != NULL) {
+      entry->max = entry->count - uxTaskGetStackHighWaterMark(tasks[i]) * sizeof(StackType_t);
+    }
+  }
+}
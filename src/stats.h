@@ -0,0 +1,82 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * stats.h - Performance counters of the bootloader
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "pmsis.h"
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// Number of command slots, one per BLCommand_t value, checked against the
+// last command in bl.h
+#define STATS_COMMANDS (17)
+
+typedef enum {
+  STATS_FLASH_ERASE = 0,
+  STATS_FLASH_PROGRAM = 1,
+  STATS_FLASH_READ = 2,
+  STATS_SPI_TRANSFER = 3,
+  STATS_COM_READ_WAIT = 4,  // Blocked in com_read waiting for a packet
+  STATS_COM_WRITE_WAIT = 5, // Blocked in com_write waiting for the TX queue
+  STATS_COMMAND = 6,        // First of the per command slots
+  STATS_COM_RX_DROPPED = STATS_COMMAND + STATS_COMMANDS, // Received packets dropped as malformed, no time
+  STATS_FLASH_LOCK_WAIT = STATS_COMMAND + STATS_COMMANDS + 1, // Blocked waiting for another task using the flash
+  STATS_ERASE_WAIT = STATS_COMMAND + STATS_COMMANDS + 2,      // Write blocked waiting for the background erase
+  // Stack of a task, count is its size and max the most of it that has been
+  // used, in bytes
+  STATS_STACK_BL = STATS_COMMAND + STATS_COMMANDS + 3,
+  STATS_STACK_COM = STATS_COMMAND + STATS_COMMANDS + 4,
+  STATS_STACK_FLASH = STATS_COMMAND + STATS_COMMANDS + 5,
+  STATS_STACK_ERASE = STATS_COMMAND + STATS_COMMANDS + 6,
+  STATS_COUNT
+} stats_counter_t;
+
+typedef struct {
+  uint32_t count;
+  uint32_t total; // us
+  uint32_t max;   // us
+} __attribute__((__packed__)) stats_entry_t;
+
+// Time in us to pass as start to stats_add
+uint32_t stats_now(void);
+
+// Account the time from start until now to counter
+void stats_add(stats_counter_t counter, uint32_t start);
+
+// Count an event that has no duration
+void stats_count(stats_counter_t counter);
+
+// Report the stack use of task in counter, stackDepth as passed to xTaskCreate
+void stats_task(stats_counter_t counter, TaskHandle_t task, uint32_t stackDepth);
+
+// Copy all the counters, optionally resetting them. The stack counters are
+// read from the tasks, they're never reset.
+void stats_get(stats_entry_t * entries, bool reset);
+
+#endif
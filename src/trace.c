@@ -0,0 +1,86 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * trace.c - Timestamped event trace
+ *
+ * Events are stored in binary in a ring buffer instead of being printed, so
+ * logging them is fast enough to use in com_task and the RTT interrupt. The
+ * ring is read out over CPX and decoded on the host.
+ */
+
+#include "pmsis.h"
+
+#include "trace.h"
+
+static PI_L2 trace_event_t ring[TRACE_SIZE];
+// Total number of events logged, the next one is stored at head % TRACE_SIZE
+static volatile uint32_t head = 0;
+static volatile bool enabled = true;
+
+void trace_log(trace_event_type_t type, uint8_t info, uint16_t arg) {
+  if (!enabled) {
+    return;
+  }
+
+  int irq = __disable_irq();
+  trace_event_t * event = &ring[head % TRACE_SIZE];
+  event->timestamp = pi_time_get_us();
+  event->type = type;
+  event->info = info;
+  event->arg = arg;
+  head++;
+  __restore_irq(irq);
+}
+
+void trace_enable(bool enable) {
+  enabled = enable;
+}
+
+uint32_t trace_count(void) {
+  return head < TRACE_SIZE ? head : TRACE_SIZE;
+}
+
+uint32_t trace_read(uint32_t index, trace_event_t * events, uint32_t count) {
+  uint32_t available = trace_count();
+  uint32_t first = head - available;
+
+  if (index >= available) {
+    return 0;
+  }
+  if (count > available - index) {
+    count = available - index;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    events[i] = ring[(first + index + i) % TRACE_SIZE];
+  }
+
+  return count;
+}
+
+void trace_clear(void) {
+  int irq = __disable_irq();
+  head = 0;
+  __restore_irq(irq);
+}
@@ -0,0 +1,81 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * trace.h - Timestamped event trace
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Number of events kept, older events are overwritten
+#define TRACE_SIZE (256)
+
+// Also used by tools/trace/trace2chrome.py, keep them in sync
+typedef enum {
+  TRACE_RTT_EDGE = 0,      // The ESP32 raised RTT
+  TRACE_SPI_START = 1,     // arg: bytes to transfer
+  TRACE_SPI_END = 2,       // arg: bytes received
+  TRACE_RX_QUEUE_WAIT = 3, // The RX queue was full, com_task is stalled
+  TRACE_RX_QUEUED = 4,     // arg: length of the received packet
+  TRACE_TX_QUEUE_WAIT = 5, // The TX queue was full, the sender is stalled
+  TRACE_TX_QUEUED = 6,     // arg: length of the packet to send
+  TRACE_CPX_RECEIVE = 7,   // arg: length, info: function
+  TRACE_CPX_SEND = 8,      // arg: length, info: function
+  TRACE_CMD_START = 9,     // info: command
+  TRACE_CMD_END = 10,      // info: command
+  TRACE_WRITE_CHUNK = 11,  // arg: sequence number
+  TRACE_WRITE_ACK = 12,    // arg: sequence number, info: status
+  TRACE_PROGRAM_START = 13, // arg: size
+  TRACE_PROGRAM_END = 14,
+  TRACE_READ_START = 15,   // arg: size
+  TRACE_READ_END = 16
+} trace_event_type_t;
+
+typedef struct {
+  uint32_t timestamp; // us
+  uint8_t type;
+  uint8_t info;
+  uint16_t arg;
+} __attribute__((__packed__)) trace_event_t;
+
+// Log an event, can be called from interrupts
+void trace_log(trace_event_type_t type, uint8_t info, uint16_t arg);
+
+// Stop or restart logging, while reading out the trace it's stopped so the
+// read out itself isn't logged
+void trace_enable(bool enable);
+
+// Number of events in the trace
+uint32_t trace_count(void);
+
+// Copy up to count events starting at index (0 is the oldest), returns the
+// number of events copied
+uint32_t trace_read(uint32_t index, trace_event_t * events, uint32_t count);
+
+void trace_clear(void);
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * digest.c - Host benchmark of the digests used by the bootloader
+ *
+ * Builds the same CRC32 and SHA-256 code as the bootloader for the host and
+ * compares their throughput with MD5 for the block sizes used when reading
+ * flash. MD5 is the one of the GAP8 SDK (pmsis_bsp), which has the same API as
+ * the one of OpenSSL, so either can be used:
+ *
+ *   gcc -O2 -Isrc -I<pmsis_bsp>/include tools/bench/digest.c src/crc32.c \
+ *       src/sha256.c <pmsis_bsp>/crc/md5.c -o digest-bench
+ *   gcc -O2 -Isrc -DBENCH_OPENSSL_MD5 tools/bench/digest.c src/crc32.c \
+ *       src/sha256.c -lcrypto -o digest-bench
+ *   ./digest-bench [size in MiB]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef BENCH_OPENSSL_MD5
+#define OPENSSL_SUPPRESS_DEPRECATED
+#include <openssl/md5.h>
+#else
+#include "bsp/crc/md5.h"
+#endif
+
+#include "crc32.h"
+#include "sha256.h"
+
+static uint32_t crc32_bitwise(uint32_t crc, const uint8_t * data, uint32_t size) {
+  uint32_t c = ~crc;
+  while (size-- > 0) {
+    c ^= *data++;
+    for (int bit = 0; bit < 8; bit++) {
+      c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+    }
+  }
+  return ~c;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char * name, uint32_t blockSize, uint32_t size, double seconds, uint32_t result) {
+  printf("%-14s %6u %10.1f MB/s  (%08X)\n", name, blockSize, size / seconds / 1e6, result);
+}
+
+int main(int argc, char ** argv) {
+  uint32_t size = (argc > 1 ? atoi(argv[1]) : 16) * 1024 * 1024;
+  uint8_t * data = malloc(size);
+  const uint32_t blockSizes[] = {256, 512, 1024};
+
+  // Something that looks like a firmware image, code followed by padding
+  srand(1);
+  for (uint32_t i = 0; i < size; i++) {
+    data[i] = i < size / 2 ? rand() : 0xFF;
+  }
+
+  printf("%-14s %6s %15s\n", "algorithm", "block", "throughput");
+
+  for (uint32_t b = 0; b < sizeof(blockSizes) / sizeof(blockSizes[0]); b++) {
+    uint32_t blockSize = blockSizes[b];
+    double start;
+    uint32_t crc;
+
+    start = now();
+    crc = 0;
+    for (uint32_t i = 0; i < size; i += blockSize) {
+      crc = crc32_bitwise(crc, &data[i], blockSize);
+    }
+    report("crc32-bitwise", blockSize, size, now() - start, crc);
+
+    start = now();
+    crc = 0;
+    for (uint32_t i = 0; i < size; i += blockSize) {
+      crc = crc32_update(crc, &data[i], blockSize);
+    }
+    report("crc32-slice4", blockSize, size, now() - start, crc);
+
+    sha256_ctx_t sha;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    start = now();
+    sha256_init(&sha);
+    for (uint32_t i = 0; i < size; i += blockSize) {
+      sha256_update(&sha, &data[i], blockSize);
+    }
+    sha256_final(&sha, digest);
+    report("sha256", blockSize, size, now() - start,
+           ((uint32_t) digest[0] << 24) | (digest[1] << 16) | (digest[2] << 8) | digest[3]);
+
+    MD5_CTX md5;
+    start = now();
+    MD5_Init(&md5);
+    for (uint32_t i = 0; i < size; i += blockSize) {
+      MD5_Update(&md5, &data[i], blockSize);
+    }
+    MD5_Final(digest, &md5);
+    report("md5", blockSize, size, now() - start,
+           ((uint32_t) digest[0] << 24) | (digest[1] << 16) | (digest[2] << 8) | digest[3]);
+  }
+
+  free(data);
+  return 0;
+}
@@ -0,0 +1,295 @@
+/**
+ * ,---------,       ____  _ __
+ * |  ,-^-,  |      / __ )(_) /_______________ _____  ___
+ * | (  O  ) |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+ * | / ,--´  |    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+ *    +------`   /_____/_/\__/\___/_/   \__,_/ /___/\___/
+ *
+ * AI-deck GAP8 second stage bootloader
+ *
+ * Copyright (C) 2022 Bitcraze AB
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, in version 3.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ *
+ * kat.c - Host known answer tests of the bootloader's decoders and digests
+ *
+ * Builds the same CRC32, SHA-256, LZ and sparse code as the bootloader for the
+ * host. CRC32 and SHA-256 are checked against published vectors, LZ and sparse
+ * against what the encoders of bootload.py make of the vectors written by
+ * tools/test/vectors.py:
+ *
+ *   python3 tools/test/vectors.py <dir>
+ *   gcc -O2 -Isrc tools/test/kat.c src/crc32.c src/sha256.c src/lz.c \
+ *       src/sparse.c -o kat
+ *   ./kat <dir>
+ *
+ * or make host-test, which doesn't need the GAP8 SDK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "sha256.h"
+#include "lz.h"
+#include "sparse.h"
+
+// Same as BL_LZ_WINDOW_SIZE
+#define LZ_WINDOW_SIZE (4096)
+
+static int tests = 0;
+static int failures = 0;
+
+static void check(int ok, const char * what, const char * name) {
+  tests++;
+  if (!ok) {
+    failures++;
+    printf("FAIL %s %s\n", what, name);
+  }
+}
+
+static uint8_t * load(const char * dir, const char * prefix, const char * name, const char * suffix, uint32_t * size) {
+  char path[512];
+  snprintf(path, sizeof(path), "%s/%s-%s.%s", dir, prefix, name, suffix);
+
+  FILE * f = fopen(path, "rb");
+  if (f == NULL) {
+    printf("Can't open %s\n", path);
+    exit(2);
+  }
+  fseek(f, 0, SEEK_END);
+  *size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t * data = malloc(*size + 1);
+  if (fread(data, 1, *size, f) != *size) {
+    printf("Can't read %s\n", path);
+    exit(2);
+  }
+  fclose(f);
+  return data;
+}
+
+static void test_crc32(void) {
+  const uint8_t * check_string = (const uint8_t *) "123456789";
+
+  check(crc32_update(0, check_string, 9) == 0xCBF43926, "crc32", "123456789");
+  check(crc32_update(crc32_update(0, check_string, 4), &check_string[4], 5) == 0xCBF43926, "crc32", "123456789 split");
+  check(crc32_update(0, check_string, 0) == 0, "crc32", "empty");
+}
+
+static void test_sha256_vector(const char * name, const uint8_t * data, uint32_t size, uint32_t repeat, const char * expected) {
+  sha256_ctx_t sha;
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  char hex[2 * SHA256_DIGEST_SIZE + 1];
+
+  sha256_init(&sha);
+  for (uint32_t i = 0; i < repeat; i++) {
+    sha256_update(&sha, data, size);
+  }
+  sha256_final(&sha, digest);
+
+  for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+    sprintf(&hex[2 * i], "%02x", digest[i]);
+  }
+  check(strcmp(hex, expected) == 0, "sha256", name);
+}
+
+// FIPS 180-2 examples
+static void test_sha256(void) {
+  const char * msg448 = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  uint8_t a[1000];
+  memset(a, 'a', sizeof(a));
+
+  test_sha256_vector("empty", (const uint8_t *) "", 0, 1,
+                     "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  test_sha256_vector("abc", (const uint8_t *) "abc", 3, 1,
+                     "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  test_sha256_vector("448 bits", (const uint8_t *) msg448, strlen(msg448), 1,
+                     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  test_sha256_vector("million a", a, sizeof(a), 1000,
+                     "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+// The output of the LZ and sparse decoding
+static uint8_t * output;
+static uint32_t outputSize;
+
+static void lz_output(uint8_t * data, uint32_t size) {
+  memcpy(&output[outputSize], data, size);
+  outputSize += size;
+}
+
+// The stream arrives in chunks of any size, the decoder is fed it in pieces
+// of these sizes in turn
+static const uint32_t pieces[] = {1, 7, 1017, 2048, 3};
+
+static void test_lz_vector(const char * dir, const char * name) {
+  uint32_t size;
+  uint32_t streamSize;
+  uint8_t * data = load(dir, "lz", name, "bin", &size);
+  uint8_t * stream = load(dir, "lz", name, "lz", &streamSize);
+  uint8_t window[LZ_WINDOW_SIZE];
+  lz_decoder_t lz;
+  int ok = 1;
+
+  output = malloc(size + 1);
+  outputSize = 0;
+  lz_init(&lz, window, sizeof(window), size, lz_output);
+
+  uint32_t offset = 0;
+  for (int i = 0; ok && offset < streamSize; i++) {
+    uint32_t piece = pieces[i % (sizeof(pieces) / sizeof(pieces[0]))];
+    piece = piece < streamSize - offset ? piece : streamSize - offset;
+    ok = lz_decode(&lz, &stream[offset], piece) >= 0;
+    offset += piece;
+  }
+
+  check(ok && outputSize == size && memcmp(output, data, size) == 0, "lz", name);
+
+  free(output);
+  free(stream);
+  free(data);
+}
+
+// A match further back than half the window is corrupt, the decoder may have
+// overwritten it already
+static void test_lz_offsets(void) {
+  uint8_t window[LZ_WINDOW_SIZE];
+  lz_decoder_t lz;
+
+  for (uint32_t matchOffset = LZ_WINDOW_SIZE / 2; matchOffset <= LZ_WINDOW_SIZE / 2 + 1; matchOffset++) {
+    // matchOffset literals, their length in the token and length bytes, then
+    // a match that far back
+    uint32_t extra = matchOffset - 15;
+    uint8_t stream[4 + LZ_WINDOW_SIZE];
+    uint32_t size = 0;
+
+    stream[size++] = 0xF0;
+    while (extra >= 255) {
+      stream[size++] = 255;
+      extra -= 255;
+    }
+    stream[size++] = extra;
+    memset(&stream[size], 0x5A, matchOffset);
+    size += matchOffset;
+    stream[size++] = matchOffset & 0xFF;
+    stream[size++] = matchOffset >> 8;
+
+    output = malloc(matchOffset + LZ_MIN_MATCH);
+    outputSize = 0;
+    lz_init(&lz, window, sizeof(window), matchOffset + LZ_MIN_MATCH, lz_output);
+    int result = lz_decode(&lz, stream, size);
+
+    if (matchOffset <= LZ_WINDOW_SIZE / 2) {
+      check(result >= 0 && outputSize == matchOffset + LZ_MIN_MATCH, "lz", "largest offset");
+    } else {
+      check(result < 0, "lz", "offset past half the window");
+    }
+    free(output);
+  }
+}
+
+static void sparse_run(BLSparseRun_t type, const uint8_t * data, uint32_t size) {
+  switch (type) {
+    case BL_SPARSE_DATA:
+      memcpy(&output[outputSize], data, size);
+      break;
+    case BL_SPARSE_ERASED:
+      memset(&output[outputSize], 0xFF, size);
+      break;
+    case BL_SPARSE_ZERO:
+      memset(&output[outputSize], 0x00, size);
+      break;
+  }
+  outputSize += size;
+}
+
+static void test_sparse_vector(const char * dir, const char * name) {
+  uint32_t size;
+  uint32_t chunksSize;
+  uint8_t * data = load(dir, "sparse", name, "bin", &size);
+  uint8_t * chunks = load(dir, "sparse", name, "chunks", &chunksSize);
+  int ok = 1;
+
+  output = malloc(size + 1);
+  outputSize = 0;
+
+  uint32_t offset = 0;
+  while (ok && offset + 2 <= chunksSize) {
+    uint32_t chunkSize = chunks[offset] | (chunks[offset + 1] << 8);
+    offset += 2;
+    ok = offset + chunkSize <= chunksSize &&
+         sparse_parse(&chunks[offset], chunkSize, size - outputSize, sparse_run) >= 0;
+    offset += chunkSize;
+  }
+
+  check(ok && outputSize == size && memcmp(output, data, size) == 0, "sparse", name);
+
+  free(output);
+  free(chunks);
+  free(data);
+}
+
+static void test_sparse_malformed(void) {
+  uint8_t run[sizeof(SparseRun_t) + 4] = {BL_SPARSE_DATA, 4, 0, 0, 0, 1, 2, 3, 4};
+
+  output = malloc(0x10000);
+  outputSize = 0;
+
+  check(sparse_parse(run, sizeof(run), 4, sparse_run) == 4, "sparse", "data run");
+  check(sparse_parse(run, sizeof(run) - 1, 4, sparse_run) < 0, "sparse", "data past the chunk");
+  check(sparse_parse(run, sizeof(SparseRun_t) - 1, 4, sparse_run) < 0, "sparse", "truncated run");
+  check(sparse_parse(run, sizeof(run), 3, sparse_run) < 0, "sparse", "more than is left");
+
+  run[0] = 3;
+  check(sparse_parse(run, sizeof(run), 4, sparse_run) < 0, "sparse", "unknown type");
+
+  free(output);
+}
+
+int main(int argc, char ** argv) {
+  char type[16];
+  char name[256];
+
+  if (argc != 2) {
+    printf("Usage: %s <vector dir>\n", argv[0]);
+    return 2;
+  }
+
+  test_crc32();
+  test_sha256();
+  test_lz_offsets();
+  test_sparse_malformed();
+
+  char path[512];
+  snprintf(path, sizeof(path), "%s/vectors.txt", argv[1]);
+  FILE * list = fopen(path, "r");
+  if (list == NULL) {
+    printf("Can't open %s\n", path);
+    return 2;
+  }
+  while (fscanf(list, "%15s %255s", type, name) == 2) {
+    if (strcmp(type, "lz") == 0) {
+      test_lz_vector(argv[1], name);
+    } else if (strcmp(type, "sparse") == 0) {
+      test_sparse_vector(argv[1], name);
+    }
+  }
+  fclose(list);
+
+  printf("%d tests, %d failed\n", tests, failures);
+  return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+#     ||          ____  _ __
+#  +------+      / __ )(_) /_______________ _____  ___
+#  | 0xBC |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+#  +------+    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+#   ||  ||    /_____/_/\__/\___/_/   \__,_/ /___/\___/
+#
+#  Copyright (C) 2022 Bitcraze AB
+#
+#  This program is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU General Public License
+#  as published by the Free Software Foundation; either version 2
+#  of the License, or (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#  You should have received a copy of the GNU General Public License along with
+#  this program; if not, write to the Free Software Foundation, Inc., 51
+#
+#  Write the LZ and sparse test vectors for tools/test/kat.c. They're made with
+#  the encoders of bootload.py, so the tests check that the GAP8 decodes what
+#  the host actually sends. For each vector there's the data and the encoded
+#  stream, and vectors.txt lists them:
+#
+#    python3 tools/test/vectors.py <dir>
+
+import ast
+import os
+import random
+import re
+import struct
+import sys
+
+# Same as BL_LZ_WINDOW_SIZE, offsets are at most half of it
+LZ_WINDOW = 4096
+
+# Largest sparse chunk bootload.py sends, a full packet less the CPX header,
+# the data marker and the sequence number
+SPARSE_CHUNK = 1022 - 2 - 1 - 2
+
+def loadEncoders():
+  """The encoders from bootload.py, which can't be imported as it starts
+     talking to the GAP8 when loaded"""
+  path = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "..", "bootload.py")
+  with open(path) as f:
+    tree = ast.parse(f.read(), path)
+  names = ["_lzLength", "_lzMatchLength", "lzCompress", "sparseChunks"]
+  functions = [node for node in tree.body if isinstance(node, ast.FunctionDef) and node.name in names]
+  scope = {"re": re, "struct": struct}
+  exec(compile(ast.Module(body=functions, type_ignores=[]), path, "exec"), scope)
+  return scope
+
+def lzVectors(rnd):
+  """Data that makes matches at, and just past, the largest offset"""
+  def repeated(period, size):
+    block = bytes(rnd.getrandbits(8) for _ in range(period))
+    return (block * (size // period + 1))[:size]
+
+  return {
+    "random": bytes(rnd.getrandbits(8) for _ in range(10000)),
+    "period-2047": repeated(2047, 12000),
+    "period-2048": repeated(2048, 12000),
+    "period-2049": repeated(2049, 12000),
+    "zeros": bytes(70000),
+    "short": b"abc",
+    "image": repeated(300, 5000) + b"\xff" * 9000 + repeated(2048, 9000),
+  }
+
+def sparseVectors(rnd):
+  """Erased and zero runs of lengths around the minimum, placed so they
+     straddle the chunk boundaries"""
+  vectors = {
+    "data": bytes(rnd.getrandbits(8) for _ in range(3 * SPARSE_CHUNK)),
+    "erased": b"\xff" * 100000,
+    "zero": bytes(100000),
+    "edges": b"\xff" * 40 + bytes(rnd.getrandbits(8) for _ in range(5000)) + bytes(40),
+  }
+
+  for n in range(20):
+    data = bytearray()
+    while len(data) < 20000:
+      data += bytes(rnd.getrandbits(8) for _ in range(rnd.choice([1, 31, 200, SPARSE_CHUNK - 10, SPARSE_CHUNK + 3])))
+      data += (b"\xff" if rnd.getrandbits(1) else b"\x00") * rnd.choice([31, 32, 33, 1000, 70000])
+    vectors["mixed-{}".format(n)] = bytes(data)
+  return vectors
+
+def main():
+  if len(sys.argv) != 2:
+    print("Usage: {} <dir>".format(sys.argv[0]))
+    sys.exit(1)
+  outDir = sys.argv[1]
+  os.makedirs(outDir, exist_ok=True)
+
+  encoders = loadEncoders()
+  rnd = random.Random(1)
+  listed = []
+
+  for (name, data) in lzVectors(rnd).items():
+    with open(os.path.join(outDir, "lz-{}.bin".format(name)), "wb") as f:
+      f.write(data)
+    with open(os.path.join(outDir, "lz-{}.lz".format(name)), "wb") as f:
+      f.write(encoders["lzCompress"](data, LZ_WINDOW))
+    listed.append("lz {}".format(name))
+
+  # The chunks are written with their size in front, as they arrive
+  for (name, data) in sparseVectors(rnd).items():
+    with open(os.path.join(outDir, "sparse-{}.bin".format(name)), "wb") as f:
+      f.write(data)
+    with open(os.path.join(outDir, "sparse-{}.chunks".format(name)), "wb") as f:
+      for chunk in encoders["sparseChunks"](data, SPARSE_CHUNK):
+        f.write(struct.pack("<H", len(chunk)) + chunk)
+    listed.append("sparse {}".format(name))
+
+  with open(os.path.join(outDir, "vectors.txt"), "w") as f:
+    f.write("\n".join(listed) + "\n")
+
+if __name__ == "__main__":
+  main()
@@ -0,0 +1,101 @@
+#!/usr/bin/env python3
+# -*- coding: utf-8 -*-
+#
+#     ||          ____  _ __
+#  +------+      / __ )(_) /_______________ _____  ___
+#  | 0xBC |     / __  / / __/ ___/ ___/ __ `/_  / / _ \
+#  +------+    / /_/ / / /_/ /__/ /  / /_/ / / /_/  __/
+#   ||  ||    /_____/_/\__/\___/_/   \__,_/ /___/\___/
+#
+#  Copyright (C) 2022 Bitcraze AB
+#
+#  This program is free software; you can redistribute it and/or
+#  modify it under the terms of the GNU General Public License
+#  as published by the Free Software Foundation; either version 2
+#  of the License, or (at your option) any later version.
+#
+#  This program is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#  You should have received a copy of the GNU General Public License along with
+#  this program; if not, write to the Free Software Foundation, Inc., 51
+#  Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+#
+#  Convert a trace read from the GAP8 bootloader (bootload.py -t) to the Chrome
+#  trace event format, which can be opened in chrome://tracing or Perfetto.
+
+import argparse
+import json
+import struct
+
+# Must match trace_event_type_t in src/trace.h. Events with a start and an end
+# are shown as durations, the rest as instants.
+EVENTS = {
+  0: ("rtt edge", "spi", "i"),
+  1: ("spi transfer", "spi", "B"),
+  2: ("spi transfer", "spi", "E"),
+  3: ("rx queue full", "com", "i"),
+  4: ("rx queued", "com", "i"),
+  5: ("tx queue full", "com", "i"),
+  6: ("tx queued", "com", "i"),
+  7: ("cpx receive", "cpx", "i"),
+  8: ("cpx send", "cpx", "i"),
+  9: ("command", "bootloader", "B"),
+  10: ("command", "bootloader", "E"),
+  11: ("write chunk", "bootloader", "i"),
+  12: ("write ack", "bootloader", "i"),
+  13: ("program", "flash", "B"),
+  14: ("program", "flash", "E"),
+  15: ("read", "flash", "B"),
+  16: ("read", "flash", "E"),
+}
+
+TRACKS = ["spi", "com", "cpx", "bootloader", "flash"]
+
+EVENT_SIZE = 8
+
+def decode(data):
+  """Return (timestamp in us, type, info, arg) of each event, with the 32 bit
+     timestamps unwrapped"""
+  events = []
+  wraps = 0
+  last = None
+  for i in range(0, len(data) - EVENT_SIZE + 1, EVENT_SIZE):
+    [timestamp, eventType, info, arg] = struct.unpack("<IBBH", data[i:i+EVENT_SIZE])
+    if last is not None and timestamp < last:
+      wraps += 1
+    last = timestamp
+    events.append((timestamp + (wraps << 32), eventType, info, arg))
+  return events
+
+def toChrome(events):
+  trace = []
+  for i, track in enumerate(TRACKS):
+    trace.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": i, "args": {"name": track}})
+
+  for (timestamp, eventType, info, arg) in events:
+    (name, track, phase) = EVENTS.get(eventType, ("unknown 0x{:02X}".format(eventType), "bootloader", "i"))
+    if eventType in (9, 10):
+      name = "command 0x{:02X}".format(info)
+    event = {"name": name, "ph": phase, "ts": timestamp, "pid": 0, "tid": TRACKS.index(track),
+             "args": {"info": info, "arg": arg}}
+    if phase == "i":
+      event["s"] = "t"
+    trace.append(event)
+
+  return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+if __name__ == "__main__":
+  parser = argparse.ArgumentParser(description="Convert a GAP8 bootloader trace to Chrome trace JSON")
+  parser.add_argument("trace", help="binary trace from bootload.py -t")
+  parser.add_argument("output", help="JSON file to write")
+  args = parser.parse_args()
+
+  with open(args.trace, "rb") as f:
+    events = decode(f.read())
+
+  with open(args.output, "w") as f:
+    json.dump(toChrome(events), f)
+
+  print("Converted {} events".format(len(events)))